@@ -11,6 +11,14 @@
 #include <linux/fs.h>
 #include <linux/ctype.h>
 #include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/uio.h>
+#include <linux/blk_types.h>
+#include <linux/vmalloc.h>
+#include <linux/zlib.h>
+#include <linux/lz4.h>
+#include <linux/crc32.h>
+#include <asm/unaligned.h>
 #include "sys_xmergesort.h"
 
 #define BUFFER_SIZE	PAGE_SIZE
@@ -38,6 +46,21 @@
 		}			                \
 	} while(0)
 
+#define SAFE_FPUT(_filp_)				\
+	do {						\
+		if ((_filp_) && !IS_ERR((_filp_))) { 	\
+			fput((_filp_));			\
+		}			                \
+	} while(0)
+
+#define SAFE_FRELEASE(_filp_, _flags_)			\
+	do {						\
+		if ((_flags_) & FLAG_FD_ARGS)		\
+			SAFE_FPUT((_filp_));		\
+		else					\
+			SAFE_FILPCLOSE((_filp_));	\
+	} while(0)
+
 #define SAFE_REMOVE(_filp_)			  		                    \
 	do {						        	            \
 		if ((_filp_) && !IS_ERR((_filp_))) { 	                	    \
@@ -52,6 +75,175 @@
 #define MAXWORD_LEN 200
 u_int rec_total;
 
+/**
+ * Scratch buffer to find a whole record from any file offset.
+ */
+#define RECBUF_LEN (2 * MAXWORD_LEN + 2)
+
+/**
+ * Staging window of O_DIRECT files and compressed inputs. Direct I/O is
+ * always issued at PAGE_SIZE aligned file offsets from page aligned memory,
+ * WINDOW_SIZE bytes at a time.
+ */
+#define WINDOW_ORDER		4
+#define WINDOW_PAGES		(1 << WINDOW_ORDER)
+#define WINDOW_SIZE		((int)(WINDOW_PAGES * PAGE_SIZE))
+
+/**
+ * Drop-behind evicts consumed input and written back output from the
+ * page cache every DROP_WINDOW_SIZE bytes.
+ */
+#define DROP_WINDOW_SIZE	(256 * PAGE_SIZE)
+
+/**
+ * gzip member format (RFC 1952), compressed data is read and written
+ * ZBUF_SIZE bytes at a time.
+ */
+#define ZBUF_SIZE		((int)(4 * PAGE_SIZE))
+#define GZIP_HDR_LEN		10
+#define GZIP_TRL_LEN		8
+#define GZIP_FHCRC		0x02
+#define GZIP_FEXTRA		0x04
+#define GZIP_FNAME		0x08
+#define GZIP_FCOMMENT		0x10
+
+/**
+ * LZ4 frame format, as written by the lz4 tool by default: independent
+ * blocks of at most 64KB - 4MB. lib/lz4 only decodes blocks, the frame is
+ * parsed here. The kernel has no xxhash, so header, block and content
+ * checksums are skipped, not verified. An output is one frame of
+ * independent 64KB blocks without checksums, its header checksum is a
+ * constant.
+ */
+#define LZ4F_MAGIC		0x184D2204
+#define LZ4F_SKIP_MAGIC		0x184D2A50	/* low 4 bits are free */
+#define LZ4F_FLG_VERSION	0x40
+#define LZ4F_FLG_INDEP		0x20
+#define LZ4F_FLG_BLK_CSUM	0x10
+#define LZ4F_FLG_SIZE		0x08
+#define LZ4F_FLG_CSUM		0x04
+#define LZ4F_FLG_DICT		0x01
+#define LZ4F_BLK_RAW		0x80000000
+#define LZ4F_BD_64KB		0x40
+#define LZ4F_HDR_CSUM		0x82	/* xxh32(FLG, BD) >> 8 */
+#define LZ4F_BLK_SIZE		(64 * 1024)
+
+/**
+ * xlz4 - LZ4 frame state of a compressed input or output
+ * @flg: FLG byte of the current frame, 0 between frames
+ * @max: block size the buffers are allocated for
+ * @blk: decompressed block
+ * @cblk: compressed block
+ * @len: valid bytes in @blk
+ * @off: bytes of @blk already handed out
+ * @wrkmem: lz4_compress workspace of an output
+ */
+typedef struct xlz4 {
+	u8		flg;
+	size_t		max;
+	char		*blk;
+	char		*cblk;
+	size_t		len;
+	size_t		off;
+	void		*wrkmem;
+} xlz4_t;
+
+/**
+ * xindex - sparse key index of the output being written
+ * @filp: index sidecar file
+ * @interval: output bytes between two entries
+ * @next: output offset from where the next entry is taken
+ * @count: entries written to the sidecar so far
+ * @ents: entries not yet written, a page worth of them
+ * @nr: number of entries in @ents
+ */
+#define XIDX_BATCH	((int)(PAGE_SIZE / sizeof(xidx_entry_t)))
+
+typedef struct xindex {
+	struct file	*filp;
+	loff_t		interval;
+	loff_t		next;
+	u_int		count;
+	xidx_entry_t	*ents;
+	int		nr;
+} xindex_t;
+
+/**
+ * xshards - shards of the output being written
+ * @name: output file name, shard n is "<name>.<n>"
+ * @mode: permissions of every shard
+ * @open_flags: extra open flags of every shard
+ * @flags: user flags
+ * @size: record bytes per shard, 0 for no limit
+ * @keys: sorted keys each starting a new shard
+ * @nr_keys: number of @keys
+ * @next_key: first of @keys no record has reached yet
+ * @filps: shard files, @filps[0] is the output file of the merge
+ * @man: manifest, one entry per shard
+ * @max: entries in @filps and @man
+ * @nr: shards opened so far
+ */
+typedef struct xshards {
+	const char	*name;
+	mode_t		mode;
+	int		open_flags;
+	int		flags;
+	loff_t		size;
+	char		**keys;
+	u_int		nr_keys;
+	u_int		next_key;
+	struct file	**filps;
+	xshard_t	*man;
+	u_int		max;
+	u_int		nr;
+} xshards_t;
+
+/**
+ * xstream - I/O state of one input or output file
+ * @filp: opened file
+ * @flags: FLAG_DIRECT_IO / FLAG_DROP_BEHIND / FLAG_(DE)COMPRESS
+ * @output: stream is written, not read
+ * @stream: pipe or socket, can only be read sequentially
+ * @pos: offset of the uncompressed data read or written so far
+ * @end: offset where reading an input stops
+ * @pages: pages backing the staging window
+ * @bvec: one bio_vec per window page, for O_DIRECT
+ * @win: kernel mapping of the staging window
+ * @win_start: stream offset of win[0]
+ * @win_len: valid bytes in the window
+ * @eof: no more data can be read into the window
+ * @dropped: page cache below this file offset is already dropped
+ * @flushed: output writeback is already started below this file offset
+ * @zs: zlib stream of a compressed file, for LZ4 only its input is used
+ * @zbuf: compressed data buffer
+ * @lz: LZ4 frame state of an LZ4 compressed file, NULL for gzip
+ * @crc: running crc32 of the uncompressed data
+ * @ix: sparse key index of an output, NULL if none
+ * @sh: shards of an output, NULL if not sharded
+ */
+typedef struct xstream {
+	struct file	*filp;
+	int		flags;
+	int		output;
+	int		stream;
+	loff_t		pos;
+	loff_t		end;
+	struct page	*pages;
+	struct bio_vec	*bvec;
+	char		*win;
+	loff_t		win_start;
+	int		win_len;
+	int		eof;
+	loff_t		dropped;
+	loff_t		flushed;
+	z_stream	*zs;
+	char		*zbuf;
+	xlz4_t		*lz;
+	u32		crc;
+	xindex_t	*ix;
+	xshards_t	*sh;
+} xstream_t;
+
 typedef enum cmp_res {
 	APPEND_STR1 	      = 1 << 0,
 	APPEND_STR2		      = 1 << 1,
@@ -117,6 +309,21 @@ compare_str(char *str1, int len1, char *str2, int len2, int flags, char *prev)
 	}	
 }
 
+/**
+ * record_cmp - compare two records honoring -i
+ * @str1: record1
+ * @str2: record2
+ * @flags: user flags
+ *
+ * returns <0, 0, >0 like strcmp.
+ */
+	static inline int
+record_cmp(const char *str1, const char *str2, int flags)
+{
+	return flags & FLAG_IGNORE_CASE ? strcasecmp(str1, str2) :
+		strcmp(str1, str2);
+}
+
 /**
  * getstring - extract the string ending with '\n'
  * @buf: input buffer which contains read data
@@ -209,32 +416,192 @@ append_record(char *record, void *dest,  int *dest_offset,
 		}                                                   	\
 	} while(0)
 
+/**
+ * Streaming set operations, at most one of them per merge.
+ */
+#define FLAG_SET_OPS	(FLAG_INTERSECT | FLAG_DIFFERENCE | FLAG_SYM_DIFF | \
+			 FLAG_COUNT_UNIQ)
+
+/**
+ * append_count - append a unique record with its count, "uniq -c" style
+ * @record: unique record
+ * @count: number of copies of @record in both inputs
+ * @dest: output buffer
+ * @dest_offset: offset in output buffer
+ */
+	static inline void
+append_count(const char *record, u_int count, void *dest, int *dest_offset)
+{
+	*dest_offset += sprintf(dest + *dest_offset, "%7u %s\n", count, record);
+	rec_total++;
+}
+
+/**
+ * set_record - account one record consumed by a set operation
+ * @record: consumed record
+ * @len: length of record
+ * @emit: record belongs to the result of the set operation
+ * @dest: output buffer
+ * @dest_offset: offset in output buffer
+ * @flags: user flags
+ * @prev: last record consumed from either input
+ * @count: copies of @prev consumed so far, for FLAG_COUNT_UNIQ
+ *
+ * Records are consumed in merged order, a record sorting before @prev
+ * means one of the inputs is not sorted and is skipped, or fails the
+ * merge with -t. With -u only the first copy of a record is looked at:
+ * at that point the heads tell whether it is in one input or in both.
+ * The count of a record is only known once a greater record is consumed,
+ * so it is appended then.
+ *
+ * returns 0 if successful, -1 on a sort error with -t.
+ */
+	static int
+set_record(char *record, int len, int emit, void *dest, int *dest_offset,
+		int flags, char *prev, u_int *count)
+{
+	int	cmp = record_cmp(record, prev, flags);
+	int	unused = 0;
+
+	if (cmp < 0)
+		return flags & FLAG_CHECK_SORTED ? -1 : 0;
+
+	if (flags & FLAG_COUNT_UNIQ) {
+		if (cmp == 0) {
+			(*count)++;
+			return 0;
+		}
+		if (*count)
+			append_count(prev, *count, dest, dest_offset);
+		*count = 1;
+	} else if (emit && !(cmp == 0 && (flags & FLAG_UNIQUE_REC))) {
+		append_record(record, dest, dest_offset, &unused, len);
+	}
+	memcpy(prev, record, len);
+	return 0;
+}
+
+/**
+ * merge_set_records - merge two input buffers into the result of a set
+ *                     operation
+ * @src1: input buffer1, NULL if input file1 is exhausted
+ * @len1: length of data present in input buffer1
+ * @src2: input buffer2, NULL if input file2 is exhausted
+ * @len2: length of data present in input buffer2
+ * @dest: output buffer, 2 * BUFFER_SIZE bytes
+ * @flags: user options
+ * @merge_err: pointer to merge_err variable
+ * @prev: last record consumed from either input
+ * @count: copies of @prev consumed so far
+ * @used1: set to number of bytes of input buffer1 merged
+ * @used2: set to number of bytes of input buffer2 merged
+ *
+ * Like the head-to-head merge, the smaller head is consumed first. Equal
+ * heads are a record in both inputs and are consumed together, so with
+ * -a the result counts copies like comm(1): min(n1, n2) copies for an
+ * intersection, n1 - n2 for a difference. A counted output can be larger
+ * than its input, merging stops once @dest can't take another record.
+ *
+ * returns number of bytes written to output buffer.
+ */
+	static int
+merge_set_records(void *src1, int len1, void *src2, int len2, void *dest,
+		int flags, int *merge_err, char *prev, u_int *count,
+		int *used1, int *used2)
+{
+	char	string1[MAXWORD_LEN], string2[MAXWORD_LEN];
+	int	slen1 = 0, slen2 = 0;
+	int	offset1 = 0, offset2 = 0, doffset = 0;
+	int	cmp, ret = 0;
+
+	while ((!src1 || offset1 < len1) && (!src2 || offset2 < len2) &&
+			doffset + RECBUF_LEN <= 2 * BUFFER_SIZE) {
+		if (src1)
+			slen1 = getstring((const char *)src1, offset1, string1);
+		if (src2)
+			slen2 = getstring((const char *)src2, offset2, string2);
+		cmp = !src2 ? -1 : !src1 ? 1 :
+			record_cmp(string1, string2, flags);
+
+		if (cmp < 0) {
+			ret = set_record(string1, slen1,
+					flags & (FLAG_DIFFERENCE | FLAG_SYM_DIFF),
+					dest, &doffset, flags, prev, count);
+			if (ret < 0)
+				break;
+			offset1 += slen1;
+		} else if (cmp > 0) {
+			ret = set_record(string2, slen2, flags & FLAG_SYM_DIFF,
+					dest, &doffset, flags, prev, count);
+			if (ret < 0)
+				break;
+			offset2 += slen2;
+		} else {
+			ret = set_record(string1, slen1, flags & FLAG_INTERSECT,
+					dest, &doffset, flags, prev, count);
+			if (ret < 0)
+				break;
+			/* the peer copy is only counted */
+			set_record(string2, slen2, 0, dest, &doffset, flags,
+					prev, count);
+			offset1 += slen1;
+			offset2 += slen2;
+		}
+	}
+
+	if (ret < 0)
+		*merge_err = -1;
+	if (used1)
+		*used1 = offset1;
+	if (used2)
+		*used2 = offset2;
+	return doffset;
+}
+
 /**
  * merge_records - extracts two strings from input buffers, compares and
  *                 append the correct string to outbut buffer based on user flags
- * @src1: input buffer1
+ * @src1: input buffer1, NULL if input file1 is exhausted
  * @len1: length of data present in input buffer1
- * @src2: input buffer2                  
+ * @src2: input buffer2, NULL if input file2 is exhausted
  * @len2: length of data present in input buffer2
  * @dest: output buffer
  * @flags: user options
  * @merge_err: pointer to merge_err variable
  * @prev: last appended string or record to output buffer
+ * @count: copies of @prev consumed so far, for FLAG_COUNT_UNIQ
+ * @used1: set to number of bytes of input buffer1 merged (may be NULL)
+ * @used2: set to number of bytes of input buffer2 merged (may be NULL)
+ *
+ * With two input buffers the merge stops at the end of either of them;
+ * the rest of the other one still has to be compared against the next
+ * chunk of its peer file. Set operations are merged by merge_set_records.
  *
  * returns number of bytes written to output buffer.
  */
 int
 merge_records(void *src1, int len1, void *src2, int len2, void *dest,int flags,
-		int *merge_err, char *prev)
+		int *merge_err, char *prev, u_int *count, int *used1, int *used2)
 {
 	char 	string1[MAXWORD_LEN], string2[MAXWORD_LEN];
 	int 	slen1, slen2;
 	int	  offset1 = 0, offset2 = 0, doffset = 0;
 	int 	equal;
+	if (flags & FLAG_SET_OPS)
+		return merge_set_records(src1, len1, src2, len2, dest, flags,
+				merge_err, prev, count, used1, used2);
+
 	if (src2 == NULL) {
 		BUG_ON(len2 >= 0);
-		goto remaining_records;
+		/* Dump remaining sorted content into outbuf*/
+		APPEND_REM_RECS(flags, merge_err, src1, offset1, len1, string1, slen1, prev);
+		goto ret;
 	}	
+	if (src1 == NULL) {
+		BUG_ON(len1 >= 0);
+		APPEND_REM_RECS(flags, merge_err, src2, offset2, len2, string2, slen2, prev);
+		goto ret;
+	}
 
 	while (offset1 < len1 &&  offset2 < len2) {
 		/*
@@ -272,17 +639,12 @@ merge_records(void *src1, int len1, void *src2, int len2, void *dest,int flags,
 				break;
 		}
 	}
-	/* Dump remaining sorted content into outbuf*/
-	if (offset2 >= len2 && offset1 < len1) {
-remaining_records:
-		APPEND_REM_RECS(flags, merge_err, src1, offset1, len1, string1, slen1, prev);
-	}
-
-	if (offset1 >= len1 && offset2 < len2) {
-		APPEND_REM_RECS(flags, merge_err, src2, offset2, len2, string2, slen2, prev);
-	}
 
 ret:
+	if (used1)
+		*used1 = offset1;
+	if (used2)
+		*used2 = offset2;
 	return doffset;
 }
 
@@ -324,167 +686,2013 @@ adjusted_bytes(char *buf, int bytes)
 }
 
 /**
- * These macros are just avoiding the duplicate code in the function
- * read_and_merge_files. some of the variables are common to the code,
- * so not passing explicitly in the code.
+ * read_full - read @len bytes from the current file position, retrying
+ *             the short reads of pipes and sockets
+ * @filp: file to read
+ * @buf: buffer to read into
+ * @len: number of bytes
+ *
+ * returns number of bytes read, less than @len only at end of file.
  */
-#define APPEND_REMAINING_FILE(_filep_, _size_, _src_buffer_, _src_len_,   \
-		_dest_,                                     \
-		_flags_, _err_, _prev_)				              \
-do {		  										                                            \
-	while((_filep_)->f_pos < (_size_)) {							                    \
-		bytes = kernel_read((_filep_), (_filep_)->f_pos,                    \
-				(_src_buffer_), BUFFER_SIZE);	                  \
-		bytes = adjusted_bytes((_src_buffer_), bytes);                      \
-		if (bytes < 0) {								                                    \
-			MDBG; 									                                          \
-			ret = bytes;								                                      \
-			goto cleanup;								                                      \
-		}	else {								                                            \
-			(_src_len_) = bytes;                                              \
-		}                                                                   \
-		bytes =  merge_records((_src_buffer_), (_src_len_), NULL, -1,       \
-				(_dest_),                                    \
-				(_flags_), &(_err_), (_prev_));              \
-		ret = kernel_write(outfilp, (_dest_), bytes, outfilp->f_pos);			  \
-		if (ret < 0) {									                                    \
-			MDBG;									                                            \
-			goto cleanup;								                                      \
-		}										                                                \
-		if (ret != bytes) {								                                  \
-			ret = -1;								                                          \
-			goto cleanup;								                                      \
-		}										                                                \
-		outfilp->f_pos += ret;								                              \
-		(_filep_)->f_pos += (_src_len_);				                            \
-	}											                                                \
-} while(0)
-
-#define CHECK_PTR_ERR(_p_)			\
-	do {	  					              \
-		if (IS_ERR((_p_))) {			  \
-			MDBG;				              \
-			ret = PTR_ERR((_p_));		  \
-			goto cleanup;			        \
-		}					                  \
-	} while(0)
+	static ssize_t
+read_full(struct file *filp, char *buf, int len)
+{
+	ssize_t	bytes;
+	int	got = 0;
+
+	while (got < len) {
+		bytes = kernel_read(filp, filp->f_pos, buf + got, len - got);
+		if (bytes < 0)
+			return bytes;
+		if (!bytes)
+			break;
+		filp->f_pos += bytes;
+		got         += bytes;
+	}
+	return got;
+}
 
-#define CHECK_FILEP(_filep_)		\
-	do {	  					              \
-		if (!(_filep_)) {			      \
-			MDBG;				              \
-			ret = -1;			            \
-			goto cleanup;			        \
-		}					                  \
-		CHECK_PTR_ERR((_filep_));		\
-	} while(0)
+/**
+ * zread - read compressed input, the data already in the input buffer of
+ *         the zlib stream first
+ * @xs: input stream
+ * @buf: buffer to read into
+ * @len: number of bytes
+ *
+ * returns number of bytes read, less than @len only at end of file.
+ */
+	static ssize_t
+zread(xstream_t *xs, char *buf, int len)
+{
+	z_stream	*zs = xs->zs;
+	int		n = min_t(int, zs->avail_in, len);
+	ssize_t		bytes;
+
+	memcpy(buf, zs->next_in, n);
+	zs->next_in  += n;
+	zs->avail_in -= n;
+	if (n == len)
+		return n;
+	bytes = read_full(xs->filp, buf + n, len - n);
+	return bytes < 0 ? bytes : n + bytes;
+}
 
 /**
- * read_and_merge_files - pulp of the implementation. reads two sorted or partially
- *                        input files by max BUFFER_SIZE chunk, merge them and put 
- *                        into placeholder output buffer. flush the output buffer
- *                        content to the output file.
- *                        does also all possible checks on input arguments and validity
- *                        of the user intended merge operation.
- * @arg: arguments passed from user
+ * gzip_read_header - skip the gzip header of a compressed input
+ * @xs: input stream, the first ZBUF_SIZE bytes of the member are in the
+ *      input buffer of its zlib stream
  *
- * returns positive value if successful else negative value.
- */                       
-	int
-read_and_merge_files(void *arg)
+ * The header has to fit in the first ZBUF_SIZE bytes of the member, the
+ * rest of that read is handed over to the inflate stream.
+ *
+ * returns 0 if successful else negative value.
+ */
+	static int
+gzip_read_header(xstream_t *xs)
 {
-	struct file	      *infilp1 = NULL, *infilp2 = NULL, *outfilp = NULL;
-	void 		          *inbuf1  = NULL, *inbuf2  = NULL, *outbuf  = NULL;
-	struct filename   *infile1 = NULL, *infile2 = NULL, *outfile = NULL;
-	int 		          bytes = -1;
-	margs_t 	        marg;
-	int		            insize1, insize2;
-	int		            ret = 0;
-	int		            flags;
-	int 		          src_len1, src_len2;
-	mode_t 		        mode = 0;
-	int               merge_err = 0;
-	char              prev[MAXWORD_LEN];
+	unsigned char	*hdr = (unsigned char *)xs->zs->next_in;
+	int		off = GZIP_HDR_LEN;
+	int		bytes = xs->zs->avail_in;
 
-	rec_total = 0;
+	if (bytes < GZIP_HDR_LEN || hdr[0] != 0x1f || hdr[1] != 0x8b ||
+			hdr[2] != Z_DEFLATED)
+		return -EINVAL;
 
-	if (copy_from_user(&marg, arg, sizeof(margs_t))) {
-		MDBG;
-		ret = -EFAULT;
-		goto cleanup;
+	if (hdr[3] & GZIP_FEXTRA) {
+		if (off + 2 > bytes)
+			return -EINVAL;
+		off += 2 + get_unaligned_le16(hdr + off);
 	}
-
-	if (!access_ok(VERIFY_READ, marg.infile1, sizeof((marg.infile1))) ||
-			!access_ok(VERIFY_READ, marg.infile2, sizeof((marg.infile2))) ||
-			!access_ok(VERIFY_READ, marg.outfile, sizeof((marg.outfile))) || 
-			!access_ok(VERIFY_WRITE, marg.records, sizeof((marg.records)))) {
-		MDBG;
-		ret = -EFAULT;
-		goto cleanup;
+	if (hdr[3] & GZIP_FNAME) {
+		while (off < bytes && hdr[off])
+			off++;
+		off++;
+	}
+	if (hdr[3] & GZIP_FCOMMENT) {
+		while (off < bytes && hdr[off])
+			off++;
+		off++;
 	}
+	if (hdr[3] & GZIP_FHCRC)
+		off += 2;
+	if (off > bytes)
+		return -EINVAL;
 
-	infile1 = getname((const char __user *)marg.infile1);
-	CHECK_PTR_ERR(infile1);
-	infile2 = getname((const char __user *)marg.infile2);
-	CHECK_PTR_ERR(infile2);
-	outfile = getname((const char __user *)marg.outfile);
-	CHECK_PTR_ERR(outfile);
+	xs->zs->next_in   = hdr + off;
+	xs->zs->avail_in  = bytes - off;
+	return 0;
+}
 
-	flags	= marg.flags;
+/**
+ * lz4_skip - skip bytes of an LZ4 compressed input
+ * @xs: input stream
+ * @len: number of bytes
+ *
+ * returns 0 if successful else negative value.
+ */
+	static int
+lz4_skip(xstream_t *xs, u32 len)
+{
+	char	tmp[64];
+	ssize_t	bytes;
+	int	n;
+
+	while (len) {
+		n = min_t(u32, len, sizeof(tmp));
+		bytes = zread(xs, tmp, n);
+		if (bytes < 0)
+			return bytes;
+		if (bytes != n)
+			return -EINVAL;
+		len -= n;
+	}
+	return 0;
+}
 
-	printk("Input Filename:%s\n", infile1->name);
-	printk("Input Filename:%s\n", infile2->name);
-	printk("Output Filename:%s\n", outfile->name);
+/**
+ * lz4_read_frame - read the header of the next LZ4 frame
+ * @xs: input stream
+ *
+ * Skippable frames are passed over, block buffers are grown to the block
+ * size of the frame.
+ *
+ * returns 1 if a frame starts, 0 at end of file else negative value.
+ */
+	static int
+lz4_read_frame(xstream_t *xs)
+{
+	xlz4_t		*lz = xs->lz;
+	unsigned char	hdr[4];
+	size_t		max;
+	ssize_t		bytes;
+	u32		magic;
+	int		ret;
+
+	while (1) {
+		bytes = zread(xs, (char *)hdr, 4);
+		if (bytes <= 0)
+			return bytes;
+		if (bytes != 4)
+			return -EINVAL;
+		magic = get_unaligned_le32(hdr);
+		if ((magic & ~0xf) != LZ4F_SKIP_MAGIC)
+			break;
+		bytes = zread(xs, (char *)hdr, 4);
+		if (bytes != 4)
+			return bytes < 0 ? bytes : -EINVAL;
+		ret = lz4_skip(xs, get_unaligned_le32(hdr));
+		if (ret < 0)
+			return ret;
+	}
+	if (magic != LZ4F_MAGIC)
+		return -EINVAL;
 
-	if (!strcmp(infile1->name,infile2->name) ||
-			!strcmp(infile1->name, outfile->name) ||
-			!strcmp(infile2->name,outfile->name))  {
-		MDBG;
-		ret = -EINVAL;
-		goto cleanup;
+	/* FLG, BD */
+	bytes = zread(xs, (char *)hdr, 2);
+	if (bytes != 2)
+		return bytes < 0 ? bytes : -EINVAL;
+	/* dependent blocks need the previous block as dictionary */
+	if ((hdr[0] & 0xc0) != LZ4F_FLG_VERSION ||
+			!(hdr[0] & LZ4F_FLG_INDEP) || (hdr[0] & LZ4F_FLG_DICT) ||
+			((hdr[1] >> 4) & 7) < 4)
+		return -EINVAL;
+	lz->flg = hdr[0];
+	max = (size_t)64 << (10 + 2 * (((hdr[1] >> 4) & 7) - 4));
+
+	/* content size, header checksum */
+	ret = lz4_skip(xs, (lz->flg & LZ4F_FLG_SIZE ? 8 : 0) + 1);
+	if (ret < 0)
+		return ret;
+
+	if (max > lz->max) {
+		vfree(lz->blk);
+		vfree(lz->cblk);
+		lz->max  = 0;
+		lz->blk  = vmalloc(max);
+		lz->cblk = vmalloc(max);
+		if (!lz->blk || !lz->cblk)
+			return -ENOMEM;
+		lz->max = max;
 	}
+	return 1;
+}
 
-	/*
-	 * open I/P files in read only mode.
-	 */ 
-	infilp1 = filp_open(infile1->name, O_RDONLY, 0);
-	CHECK_FILEP(infilp1);
+/**
+ * lz4_read_block - decompress the next block of an LZ4 compressed input
+ * @xs: input stream
+ *
+ * returns 1 if a block is read, 0 at end of file else negative value.
+ */
+	static int
+lz4_read_block(xstream_t *xs)
+{
+	xlz4_t		*lz = xs->lz;
+	unsigned char	hdr[4];
+	size_t		len;
+	ssize_t		bytes;
+	u32		size;
+	int		ret;
+
+	do {
+		if (!lz->flg) {
+			ret = lz4_read_frame(xs);
+			if (ret <= 0)
+				return ret;
+		}
 
-	infilp2 = filp_open(infile2->name, O_RDONLY, 0);
-	CHECK_FILEP(infilp2);
-	/*
-	 * merge should be allowed only on regular files.
-	 */
-#define inode_mode(_filep_) ((_filep_)->f_inode->i_mode)
-#define _mode(T,_mode_)  ((S_IRWX ## T) & (_mode_))
-	if (!S_ISREG(inode_mode(infilp1)) || !S_ISREG(inode_mode(infilp2))) {
-		ret = -EPERM;
-		goto cleanup;
-	} else {
-		/*
-		 * mode of output file will be no more permissive than the
-		 * input file permissions.
-		 * e.g. if infile1 : 0555, infile2 : 0400
-		 *      then outfile permissions : 0400
-		 */        
-		mode |= _mode(U,inode_mode(infilp1)) > _mode(U,inode_mode(infilp2))? 
-			_mode(U,inode_mode(infilp2)):
-			_mode(U,inode_mode(infilp1));
+		bytes = zread(xs, (char *)hdr, 4);
+		if (bytes != 4)
+			return bytes < 0 ? bytes : -EINVAL;
+		size = get_unaligned_le32(hdr);
+		if (!size) {
+			/* end mark, the next frame may follow */
+			ret = lz4_skip(xs, lz->flg & LZ4F_FLG_CSUM ? 4 : 0);
+			if (ret < 0)
+				return ret;
+			lz->flg = 0;
+			lz->len = 0;
+			continue;
+		}
 
-		mode |= _mode(G,inode_mode(infilp1)) > _mode(G,inode_mode(infilp2))? 
-			_mode(G,inode_mode(infilp2)):
-			_mode(G,inode_mode(infilp1));
+		len = size & ~LZ4F_BLK_RAW;
+		if (len > lz->max)
+			return -EINVAL;
+		bytes = zread(xs, size & LZ4F_BLK_RAW ? lz->blk : lz->cblk, len);
+		if (bytes != len)
+			return bytes < 0 ? bytes : -EINVAL;
+		ret = lz4_skip(xs, lz->flg & LZ4F_FLG_BLK_CSUM ? 4 : 0);
+		if (ret < 0)
+			return ret;
+
+		if (!(size & LZ4F_BLK_RAW)) {
+			bytes = len;
+			len   = lz->max;
+			if (lz4_decompress_unknownoutputsize(
+						(unsigned char *)lz->cblk, bytes,
+						(unsigned char *)lz->blk, &len) < 0)
+				return -EINVAL;
+		}
+		lz->len = len;
+	} while (!lz->len);
 
-		mode |= _mode(O,inode_mode(infilp1)) > _mode(O,inode_mode(infilp2))? 
-			_mode(O,inode_mode(infilp2)):
-			_mode(O,inode_mode(infilp1));
-		printk ("Output file mode: %o\n", mode);
-	}
+	lz->off = 0;
+	return 1;
+}
 
-	/*
+/**
+ * gzip_check_trailer - verify crc32 and size of an inflated input
+ * @xs: input stream, inflate has reached the end of the stream
+ *
+ * returns 0 if successful else negative value.
+ */
+	static int
+gzip_check_trailer(xstream_t *xs)
+{
+	unsigned char	trl[GZIP_TRL_LEN];
+	ssize_t		bytes;
+
+	bytes = zread(xs, (char *)trl, GZIP_TRL_LEN);
+	if (bytes < 0)
+		return bytes;
+	if (bytes != GZIP_TRL_LEN)
+		return -EINVAL;
+
+	if (get_unaligned_le32(trl) != ~xs->crc ||
+			get_unaligned_le32(trl + 4) != (u32)xs->zs->total_out)
+		return -EINVAL;
+	return 0;
+}
+
+/**
+ * gzip_next_member - start inflating the next member of a gzip input
+ * @xs: input stream, the trailer of the previous member is consumed
+ *
+ * Concatenated gzip files (cat a.gz b.gz, bgzip) are one input.
+ *
+ * returns 1 if a member starts, 0 at end of file else negative value.
+ */
+	static int
+gzip_next_member(xstream_t *xs)
+{
+	z_stream	*zs = xs->zs;
+	int		n = zs->avail_in;
+	ssize_t		bytes;
+	int		ret;
+
+	/* the next header has to be in the buffer in one piece */
+	memmove(xs->zbuf, zs->next_in, n);
+	bytes = read_full(xs->filp, xs->zbuf + n, ZBUF_SIZE - n);
+	if (bytes < 0)
+		return bytes;
+	zs->next_in  = (Byte *)xs->zbuf;
+	zs->avail_in = n + bytes;
+	if (!zs->avail_in)
+		return 0;
+
+	ret = gzip_read_header(xs);
+	if (ret < 0)
+		return ret;
+	if (zlib_inflateReset(zs) != Z_OK)
+		return -EINVAL;
+	xs->crc = ~0;
+	return 1;
+}
+
+/**
+ * gzip_write_header - write a minimal gzip header to a compressed output
+ * @xs: output stream
+ *
+ * returns 0 if successful else negative value.
+ */
+	static int
+gzip_write_header(xstream_t *xs)
+{
+	static const char hdr[GZIP_HDR_LEN] = {
+		0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3 /* unix */
+	};
+	ssize_t	bytes;
+
+	bytes = kernel_write(xs->filp, hdr, GZIP_HDR_LEN, xs->filp->f_pos);
+	if (bytes < 0)
+		return bytes;
+	if (bytes != GZIP_HDR_LEN)
+		return -1;
+	xs->filp->f_pos += bytes;
+	return 0;
+}
+
+/**
+ * lz4_write_header - set up an LZ4 compressed output and start its frame
+ * @xs: output stream
+ *
+ * returns 0 if successful else negative value.
+ */
+	static int
+lz4_write_header(xstream_t *xs)
+{
+	static const char hdr[7] = {
+		0x04, 0x22, 0x4d, 0x18,		/* LZ4F_MAGIC */
+		LZ4F_FLG_VERSION | LZ4F_FLG_INDEP, LZ4F_BD_64KB, LZ4F_HDR_CSUM
+	};
+	xlz4_t	*lz;
+	ssize_t	bytes;
+
+	xs->lz = kzalloc(sizeof(xlz4_t), GFP_KERNEL);
+	if (!xs->lz)
+		return -ENOMEM;
+	lz         = xs->lz;
+	lz->max    = LZ4F_BLK_SIZE;
+	lz->blk    = vmalloc(lz->max);
+	/* room for the block size in front of the compressed block */
+	lz->cblk   = vmalloc(4 + lz4_compressbound(lz->max));
+	lz->wrkmem = vmalloc(LZ4_MEM_COMPRESS);
+	if (!lz->blk || !lz->cblk || !lz->wrkmem)
+		return -ENOMEM;
+
+	bytes = kernel_write(xs->filp, hdr, sizeof(hdr), xs->filp->f_pos);
+	if (bytes < 0)
+		return bytes;
+	if (bytes != sizeof(hdr))
+		return -1;
+	xs->filp->f_pos += bytes;
+	return 0;
+}
+
+/**
+ * zstream_init - set up the zlib state of a compressed file
+ * @xs: stream
+ * @output: deflate into the file instead of inflating from it
+ *
+ * Raw deflate streams are used, the gzip framing is done here. Files
+ * can also be LZ4 frames, which only use the input buffer of the zlib
+ * stream.
+ *
+ * returns 0 if successful else negative value.
+ */
+	static int
+zstream_init(xstream_t *xs, int output)
+{
+	z_stream	*zs;
+	ssize_t		bytes;
+
+	xs->zs   = kzalloc(sizeof(z_stream), GFP_KERNEL);
+	xs->zbuf = kmalloc(ZBUF_SIZE, GFP_KERNEL);
+	if (!xs->zs || !xs->zbuf)
+		return -ENOMEM;
+	zs      = xs->zs;
+	xs->crc = ~0;
+
+	if (output && (xs->flags & FLAG_LZ4))
+		return lz4_write_header(xs);
+	if (output) {
+		zs->workspace = vzalloc(zlib_deflate_workspacesize(MAX_WBITS,
+					MAX_MEM_LEVEL));
+		if (!zs->workspace)
+			return -ENOMEM;
+		if (zlib_deflateInit2(zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+					-MAX_WBITS, MAX_MEM_LEVEL,
+					Z_DEFAULT_STRATEGY) != Z_OK)
+			return -EINVAL;
+		return gzip_write_header(xs);
+	}
+
+	/* the format is told by the magic at the start of the file */
+	bytes = read_full(xs->filp, xs->zbuf, ZBUF_SIZE);
+	if (bytes < 0)
+		return bytes;
+	zs->next_in  = (Byte *)xs->zbuf;
+	zs->avail_in = bytes;
+	if (bytes >= 4 && ((get_unaligned_le32(xs->zbuf) & ~0xf) ==
+				LZ4F_SKIP_MAGIC ||
+				get_unaligned_le32(xs->zbuf) == LZ4F_MAGIC)) {
+		xs->lz = kzalloc(sizeof(xlz4_t), GFP_KERNEL);
+		if (!xs->lz)
+			return -ENOMEM;
+		return 0;
+	}
+
+	zs->workspace = vzalloc(zlib_inflate_workspacesize());
+	if (!zs->workspace)
+		return -ENOMEM;
+	if (zlib_inflateInit2(zs, -MAX_WBITS) != Z_OK)
+		return -EINVAL;
+	return gzip_read_header(xs);
+}
+
+/**
+ * xstream_init - set up the I/O state of an opened file
+ * @xs: stream to initialize
+ * @filp: opened file
+ * @flags: user flags
+ * @output: @filp is the output file
+ *
+ * Files that can't be read at an offset (pipes, sockets) have no page
+ * cache to drop and are read through the staging window.
+ *
+ * returns 0 if successful else negative value.
+ */
+	static int
+xstream_init(xstream_t *xs, struct file *filp, int flags, int output)
+{
+	int i, ret;
+
+	memset(xs, 0, sizeof(*xs));
+	xs->end = LLONG_MAX;
+	if (!filp)
+		return 0;	/* no file, an empty input */
+	xs->filp   = filp;
+	xs->output = output;
+	xs->stream = !(filp->f_mode & FMODE_PREAD);
+	xs->flags  = flags & (FLAG_DIRECT_IO | FLAG_DROP_BEHIND |
+			(output ? FLAG_COMPRESS | FLAG_LZ4 : FLAG_DECOMPRESS));
+	if (xs->stream)
+		xs->flags &= ~FLAG_DROP_BEHIND;
+	/* pages before an already opened file's offset are not ours */
+	xs->dropped = xs->flushed = round_down(filp->f_pos, PAGE_SIZE);
+
+	if (xs->flags & (FLAG_COMPRESS | FLAG_DECOMPRESS)) {
+		ret = zstream_init(xs, output);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (!(xs->flags & (FLAG_DIRECT_IO | FLAG_DECOMPRESS)) &&
+			(output || !xs->stream))
+		return 0;
+
+	xs->pages = alloc_pages(GFP_KERNEL, WINDOW_ORDER);
+	if (!xs->pages)
+		return -ENOMEM;
+	xs->win = page_address(xs->pages);
+
+	if (!(xs->flags & FLAG_DIRECT_IO))
+		return 0;
+
+	xs->bvec = kcalloc(WINDOW_PAGES, sizeof(struct bio_vec), GFP_KERNEL);
+	if (!xs->bvec)
+		return -ENOMEM;
+	for (i = 0; i < WINDOW_PAGES; i++) {
+		xs->bvec[i].bv_page   = xs->pages + i;
+		xs->bvec[i].bv_len    = PAGE_SIZE;
+		xs->bvec[i].bv_offset = 0;
+	}
+	return 0;
+}
+
+/**
+ * xstream_release - free the I/O state of a file
+ * @xs: stream to release
+ */
+	static void
+xstream_release(xstream_t *xs)
+{
+	if (xs->pages) {
+		__free_pages(xs->pages, WINDOW_ORDER);
+		xs->pages = NULL;
+	}
+	if (xs->zs) {
+		vfree(xs->zs->workspace);
+		SAFE_FREE(xs->zs);
+	}
+	SAFE_FREE(xs->zbuf);
+	if (xs->lz) {
+		vfree(xs->lz->blk);
+		vfree(xs->lz->cblk);
+		vfree(xs->lz->wrkmem);
+		SAFE_FREE(xs->lz);
+	}
+	SAFE_FREE(xs->bvec);
+	xs->win = NULL;
+}
+
+/**
+ * drop_behind - evict consumed or written back pages from the page cache
+ * @xs: stream
+ * @pos: everything below this file offset is consumed or written
+ * @final: drop everything below @pos, don't wait for a full window
+ *
+ * Dirty output pages can't be dropped before writeback, so writeback of
+ * the newest window is started and the previous one is waited on.
+ */
+	static void
+drop_behind(xstream_t *xs, loff_t pos, int final)
+{
+	struct address_space	*mapping;
+	loff_t			end = pos;
+
+	/* an empty input has no file */
+	if (!xs->filp || !(xs->flags & FLAG_DROP_BEHIND) || pos <= xs->dropped)
+		return;
+	if (!final && pos - max(xs->dropped, xs->flushed) < DROP_WINDOW_SIZE)
+		return;
+	mapping = xs->filp->f_mapping;
+
+	if (xs->output) {
+		if (final) {
+			filemap_write_and_wait_range(mapping, xs->dropped, pos - 1);
+		} else {
+			filemap_fdatawrite_range(mapping, xs->flushed, pos - 1);
+			if (xs->flushed > xs->dropped)
+				filemap_fdatawait_range(mapping, xs->dropped,
+						xs->flushed - 1);
+			end = xs->flushed;
+			xs->flushed = pos;
+		}
+	}
+
+	if (final)
+		invalidate_mapping_pages(mapping, xs->dropped >> PAGE_SHIFT,
+				(pos - 1) >> PAGE_SHIFT);
+	else if (end >> PAGE_SHIFT > xs->dropped >> PAGE_SHIFT)
+		invalidate_mapping_pages(mapping, xs->dropped >> PAGE_SHIFT,
+				(end >> PAGE_SHIFT) - 1);
+	xs->dropped = round_down(end, PAGE_SIZE);
+}
+
+/**
+ * dio_rw - O_DIRECT read or write of a part of the staging window
+ * @xs: stream
+ * @rw: READ or WRITE
+ * @off: page aligned offset in the window
+ * @len: number of bytes
+ * @pos: page aligned file offset
+ *
+ * returns number of bytes transferred or negative error.
+ */
+	static ssize_t
+dio_rw(xstream_t *xs, int rw, int off, int len, loff_t pos)
+{
+	struct iov_iter	iter;
+	ssize_t		ret;
+
+	iov_iter_bvec(&iter, ITER_BVEC | rw, xs->bvec + (off >> PAGE_SHIFT),
+			DIV_ROUND_UP(len, PAGE_SIZE), len);
+	if (rw == READ)
+		return vfs_iter_read(xs->filp, &iter, &pos);
+
+	/* vfs_iter_write leaves freeze protection to the caller */
+	file_start_write(xs->filp);
+	ret = vfs_iter_write(xs->filp, &iter, &pos);
+	file_end_write(xs->filp);
+	return ret;
+}
+
+/**
+ * inflate_fill - decompress max @len bytes of a compressed input
+ * @xs: input stream
+ * @out: buffer to decompress into
+ * @len: size of @out
+ *
+ * sets eof and verifies the gzip trailer at the end of the stream.
+ *
+ * returns number of decompressed bytes or negative error.
+ */
+	static int
+inflate_fill(xstream_t *xs, char *out, int len)
+{
+	z_stream	*zs = xs->zs;
+	Byte		*start;
+	ssize_t		bytes;
+	int		ret;
+
+	zs->next_out  = (Byte *)out;
+	zs->avail_out = len;
+	while (zs->avail_out) {
+		if (!zs->avail_in) {
+			bytes = kernel_read(xs->filp, xs->filp->f_pos,
+					xs->zbuf, ZBUF_SIZE);
+			if (bytes < 0)
+				return bytes;
+			if (!bytes)
+				return -EINVAL;	/* truncated stream */
+			xs->filp->f_pos += bytes;
+			zs->next_in  = (Byte *)xs->zbuf;
+			zs->avail_in = bytes;
+		}
+		start = zs->next_out;
+		ret   = zlib_inflate(zs, Z_SYNC_FLUSH);
+		xs->crc = crc32_le(xs->crc, start, zs->next_out - start);
+		if (ret == Z_STREAM_END) {
+			ret = gzip_check_trailer(xs);
+			if (ret < 0)
+				return ret;
+			ret = gzip_next_member(xs);
+			if (ret < 0)
+				return ret;
+			if (!ret) {
+				xs->eof = 1;
+				break;
+			}
+			continue;
+		}
+		if (ret != Z_OK)
+			return -EINVAL;
+	}
+	return len - zs->avail_out;
+}
+
+/**
+ * lz4_fill - decompress up to @len bytes of an LZ4 compressed input
+ * @xs: input stream
+ * @out: buffer to fill
+ * @len: number of bytes
+ *
+ * returns number of bytes filled, less than @len only at end of file.
+ */
+	static int
+lz4_fill(xstream_t *xs, char *out, int len)
+{
+	xlz4_t	*lz = xs->lz;
+	int	got = 0, n, ret;
+
+	while (got < len) {
+		if (lz->off == lz->len) {
+			ret = lz4_read_block(xs);
+			if (ret < 0)
+				return ret;
+			if (!ret) {
+				xs->eof = 1;
+				break;
+			}
+		}
+		n = min_t(size_t, len - got, lz->len - lz->off);
+		memcpy(out + got, lz->blk + lz->off, n);
+		lz->off += n;
+		got     += n;
+	}
+	return got;
+}
+
+/**
+ * deflate_write - compress @len bytes of @buf into a compressed output
+ * @xs: output stream
+ * @buf: data to compress
+ * @len: length of data
+ * @flush: Z_NO_FLUSH, or Z_FINISH to end the stream
+ *
+ * returns @len if successful else negative value.
+ */
+	static int
+deflate_write(xstream_t *xs, const char *buf, int len, int flush)
+{
+	z_stream	*zs = xs->zs;
+	struct file	*filp = xs->filp;
+	ssize_t		bytes;
+	int		ret, out;
+
+	xs->crc = crc32_le(xs->crc, (const unsigned char *)buf, len);
+	zs->next_in  = (const Byte *)buf;
+	zs->avail_in = len;
+	do {
+		zs->next_out  = (Byte *)xs->zbuf;
+		zs->avail_out = ZBUF_SIZE;
+		ret = zlib_deflate(zs, flush);
+		if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+			return -EINVAL;
+
+		out = ZBUF_SIZE - zs->avail_out;
+		if (out) {
+			bytes = kernel_write(filp, xs->zbuf, out, filp->f_pos);
+			if (bytes < 0)
+				return bytes;
+			if (bytes != out)
+				return -1;
+			filp->f_pos += bytes;
+		}
+	} while (!zs->avail_out || (flush == Z_FINISH && ret != Z_STREAM_END));
+
+	xs->pos += len;
+	drop_behind(xs, filp->f_pos, 0);
+	return len;
+}
+
+/**
+ * lz4_write_block - compress the buffered block of an LZ4 compressed output
+ * @xs: output stream
+ *
+ * A block that doesn't shrink is stored uncompressed.
+ *
+ * returns 0 if successful else negative value.
+ */
+	static int
+lz4_write_block(xstream_t *xs)
+{
+	xlz4_t	*lz = xs->lz;
+	size_t	clen = lz4_compressbound(lz->len);
+	ssize_t	bytes;
+
+	if (!lz->len)
+		return 0;
+	if (lz4_compress((unsigned char *)lz->blk, lz->len,
+				(unsigned char *)lz->cblk + 4, &clen,
+				lz->wrkmem) < 0 || clen >= lz->len) {
+		memcpy(lz->cblk + 4, lz->blk, lz->len);
+		put_unaligned_le32(lz->len | LZ4F_BLK_RAW, lz->cblk);
+		clen = lz->len;
+	} else {
+		put_unaligned_le32(clen, lz->cblk);
+	}
+
+	bytes = kernel_write(xs->filp, lz->cblk, 4 + clen, xs->filp->f_pos);
+	if (bytes < 0)
+		return bytes;
+	if (bytes != 4 + clen)
+		return -1;
+	xs->filp->f_pos += bytes;
+	lz->len = 0;
+	return 0;
+}
+
+/**
+ * lz4_write - compress @len bytes of @buf into an LZ4 compressed output
+ * @xs: output stream
+ * @buf: data to compress
+ * @len: length of data
+ *
+ * returns @len if successful else negative value.
+ */
+	static int
+lz4_write(xstream_t *xs, const char *buf, int len)
+{
+	xlz4_t	*lz = xs->lz;
+	int	copied = 0, n, ret;
+
+	while (copied < len) {
+		n = min_t(int, len - copied, lz->max - lz->len);
+		memcpy(lz->blk + lz->len, buf + copied, n);
+		lz->len += n;
+		copied  += n;
+		if (lz->len == lz->max) {
+			ret = lz4_write_block(xs);
+			if (ret < 0)
+				return ret;
+		}
+	}
+
+	xs->pos += len;
+	drop_behind(xs, xs->filp->f_pos, 0);
+	return len;
+}
+
+/**
+ * read_chunk - read max BUFFER_SIZE bytes of an input stream from its
+ *              current position
+ * @xs: input stream
+ * @buf: buffer to read into (unused for windowed streams)
+ * @chunk: set to the start of the read data
+ *
+ * O_DIRECT, compressed and pipe inputs are served from the staging window. It
+ * is refilled keeping the not yet consumed data, for O_DIRECT from the
+ * page of the current position on so that reads stay aligned. The last
+ * read of the file is short and ends with the unaligned tail. Plain files
+ * are read up to @xs->end only, which is always a record boundary.
+ *
+ * returns adjusted length of valid data in *chunk, 0 at end of file.
+ */
+	static int
+read_chunk(xstream_t *xs, void *buf, char **chunk)
+{
+	loff_t	pos = xs->pos, keep_start;
+	int	keep, len;
+	ssize_t	bytes;
+
+	if (!xs->filp || pos >= xs->end)
+		return 0;
+	if (!xs->win) {
+		*chunk = buf;
+		len = min_t(loff_t, BUFFER_SIZE, xs->end - pos);
+		return adjusted_bytes(buf, kernel_read(xs->filp, pos, buf, len));
+	}
+
+	if (pos + BUFFER_SIZE > xs->win_start + xs->win_len && !xs->eof) {
+		keep_start = xs->flags & FLAG_DIRECT_IO ?
+			round_down(pos, PAGE_SIZE) : pos;
+		keep = xs->win_start + xs->win_len - keep_start;
+		memmove(xs->win, xs->win + (keep_start - xs->win_start), keep);
+		xs->win_start = keep_start;
+		xs->win_len   = keep;
+
+		if (xs->flags & FLAG_DIRECT_IO) {
+			bytes = dio_rw(xs, READ, keep, WINDOW_SIZE - keep,
+					keep_start + keep);
+			if (bytes >= 0 && bytes < WINDOW_SIZE - keep)
+				xs->eof = 1;
+		} else if (xs->lz) {
+			/* leave room for the '\n' adjusted_bytes may append */
+			bytes = lz4_fill(xs, xs->win + keep,
+					WINDOW_SIZE - keep - 1);
+		} else if (xs->zs) {
+			bytes = inflate_fill(xs, xs->win + keep,
+					WINDOW_SIZE - keep - 1);
+		} else {
+			bytes = read_full(xs->filp, xs->win + keep,
+					WINDOW_SIZE - keep - 1);
+			if (bytes >= 0 && bytes < WINDOW_SIZE - keep - 1)
+				xs->eof = 1;
+		}
+		if (bytes < 0)
+			return bytes;
+		xs->win_len += bytes;
+	}
+
+	/*
+	 * an unterminated last record was merged with the '\n' that
+	 * adjusted_bytes appended, which leaves pos one past the data.
+	 */
+	len = xs->win_start + xs->win_len - pos;
+	if (len <= 0)
+		return 0;
+	if (len > BUFFER_SIZE)
+		len = BUFFER_SIZE;
+	*chunk = xs->win + (pos - xs->win_start);
+	return adjusted_bytes(*chunk, len);
+}
+
+/**
+ * xstream_consume - advance an input stream past merged data
+ * @xs: input stream
+ * @len: number of bytes merged
+ */
+	static inline void
+xstream_consume(xstream_t *xs, int len)
+{
+	xs->pos += len;
+	drop_behind(xs, xs->zs ? xs->filp->f_pos : xs->pos, 0);
+}
+
+/**
+ * xindex_flush - write the buffered entries to the index sidecar
+ * @ix: index
+ *
+ * returns 0 if successful else negative value.
+ */
+	static int
+xindex_flush(xindex_t *ix)
+{
+	int	len = ix->nr * sizeof(xidx_entry_t);
+	ssize_t	bytes;
+
+	if (!len)
+		return 0;
+	bytes = kernel_write(ix->filp, (char *)ix->ents, len,
+			sizeof(xidx_hdr_t) + ix->count * sizeof(xidx_entry_t));
+	if (bytes < 0)
+		return bytes;
+	if (bytes != len)
+		return -1;
+	ix->count += ix->nr;
+	ix->nr     = 0;
+	return 0;
+}
+
+/**
+ * index_records - take index entries from output about to be written
+ * @ix: index
+ * @buf: output data, whole records
+ * @len: length of output data
+ * @base: output offset of @buf
+ *
+ * An entry is taken for the first record starting at or after every
+ * @ix->interval bytes of output.
+ *
+ * returns 0 if successful else negative value.
+ */
+	static int
+index_records(xindex_t *ix, const char *buf, int len, loff_t base)
+{
+	xidx_entry_t	*ent;
+	int		i, k, ret;
+
+	while (ix->next < base + len) {
+		i = ix->next - base;
+		if (i > 0 && buf[i - 1] != '\n') {
+			while (i < len && buf[i] != '\n')
+				i++;
+			if (++i >= len) {
+				/* next record starts in the next write */
+				ix->next = base + len;
+				break;
+			}
+		}
+
+		ent = &ix->ents[ix->nr];
+		memset(ent, 0, sizeof(*ent));
+		ent->offset = base + i;
+		for (k = 0; k < XIDX_KEY_LEN - 1 && buf[i + k] != '\n'; k++)
+			ent->key[k] = buf[i + k];
+		ix->next = base + i + ix->interval;
+
+		if (++ix->nr == XIDX_BATCH) {
+			ret = xindex_flush(ix);
+			if (ret < 0)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+/**
+ * xindex_finish - write the remaining entries and the index header
+ * @ix: index
+ * @flags: user flags
+ *
+ * returns 0 if successful else negative value.
+ */
+	static int
+xindex_finish(xindex_t *ix, int flags)
+{
+	xidx_hdr_t	hdr;
+	ssize_t		bytes;
+	int		ret;
+
+	ret = xindex_flush(ix);
+	if (ret < 0)
+		return ret;
+
+	hdr.magic    = XIDX_MAGIC;
+	hdr.interval = ix->interval >> 10;
+	hdr.flags    = flags & FLAG_IGNORE_CASE;
+	hdr.count    = ix->count;
+	bytes = kernel_write(ix->filp, (char *)&hdr, sizeof(hdr), 0);
+	if (bytes < 0)
+		return bytes;
+	if (bytes != sizeof(hdr))
+		return -1;
+	return 0;
+}
+
+/**
+ * xstream_write - append @len bytes of @buf to the output stream
+ * @xs: output stream
+ * @buf: data to write
+ * @len: length of data
+ *
+ * For O_DIRECT the data is staged and written a full window at a time;
+ * xstream_flush writes whatever is left.
+ *
+ * returns @len if successful else negative value.
+ */
+	static int
+xstream_write(xstream_t *xs, const char *buf, int len)
+{
+	int		copied = 0, n;
+	ssize_t		ret;
+
+	if (xs->flags & FLAG_LZ4)
+		return lz4_write(xs, buf, len);
+	if (xs->flags & FLAG_COMPRESS)
+		return deflate_write(xs, buf, len, Z_NO_FLUSH);
+
+	if (!(xs->flags & FLAG_DIRECT_IO)) {
+		ret = kernel_write(xs->filp, buf, len, xs->pos);
+		if (ret < 0)
+			return ret;
+		if (ret != len)
+			return -1;
+		xs->pos += ret;
+		drop_behind(xs, xs->pos, 0);
+		return len;
+	}
+
+	while (copied < len) {
+		n = min_t(int, len - copied, WINDOW_SIZE - xs->win_len);
+		memcpy(xs->win + xs->win_len, buf + copied, n);
+		xs->win_len += n;
+		copied      += n;
+		if (xs->win_len == WINDOW_SIZE) {
+			ret = dio_rw(xs, WRITE, 0, WINDOW_SIZE, xs->win_start);
+			if (ret < 0)
+				return ret;
+			if (ret != WINDOW_SIZE)
+				return -1;
+			xs->win_start += WINDOW_SIZE;
+			xs->win_len    = 0;
+		}
+	}
+	xs->pos += len;
+	return len;
+}
+
+/**
+ * xstream_flush - write out the data staged in an output stream
+ * @xs: output stream
+ *
+ * A compressed output is finished with the gzip trailer or the LZ4 end
+ * mark. The unaligned
+ * tail of an O_DIRECT output can't be written directly, so O_DIRECT is
+ * turned off for the file and the tail goes through the page cache.
+ *
+ * returns 0 if successful else negative value.
+ */
+	static int
+xstream_flush(xstream_t *xs)
+{
+	struct file	*filp = xs->filp;
+	unsigned char	trl[GZIP_TRL_LEN];
+	int		aligned;
+	ssize_t		ret;
+
+	if (xs->flags & FLAG_LZ4) {
+		ret = lz4_write_block(xs);
+		if (ret < 0)
+			return ret;
+		put_unaligned_le32(0, trl);
+		ret = kernel_write(filp, (char *)trl, 4, filp->f_pos);
+		if (ret < 0)
+			return ret;
+		if (ret != 4)
+			return -1;
+		filp->f_pos += ret;
+		drop_behind(xs, filp->f_pos, 1);
+		return 0;
+	}
+	if (xs->flags & FLAG_COMPRESS) {
+		ret = deflate_write(xs, NULL, 0, Z_FINISH);
+		if (ret < 0)
+			return ret;
+		put_unaligned_le32(~xs->crc, trl);
+		put_unaligned_le32((u32)xs->pos, trl + 4);
+		ret = kernel_write(filp, (char *)trl, GZIP_TRL_LEN, filp->f_pos);
+		if (ret < 0)
+			return ret;
+		if (ret != GZIP_TRL_LEN)
+			return -1;
+		filp->f_pos += ret;
+		drop_behind(xs, filp->f_pos, 1);
+		return 0;
+	}
+
+	if (!(xs->flags & FLAG_DIRECT_IO)) {
+		drop_behind(xs, xs->pos, 1);
+		return 0;
+	}
+
+	aligned = round_down(xs->win_len, PAGE_SIZE);
+	if (aligned) {
+		ret = dio_rw(xs, WRITE, 0, aligned, xs->win_start);
+		if (ret < 0)
+			return ret;
+		if (ret != aligned)
+			return -1;
+	}
+	if (xs->win_len > aligned) {
+		spin_lock(&filp->f_lock);
+		filp->f_flags &= ~O_DIRECT;
+		spin_unlock(&filp->f_lock);
+		ret = kernel_write(filp, xs->win + aligned, xs->win_len - aligned,
+				xs->win_start + aligned);
+		if (ret < 0)
+			return ret;
+		if (ret != xs->win_len - aligned)
+			return -1;
+	}
+	xs->win_start += xs->win_len;
+	xs->win_len    = 0;
+	return 0;
+}
+
+/**
+ * copy_key - copy a key bound from user space
+ * @ukey: user key, NULL for no bound
+ * @key: set to the kmalloc'ed key, NULL for no bound
+ *
+ * returns 0 if successful else negative value.
+ */
+	static int
+copy_key(const char __user *ukey, char **key)
+{
+	long len;
+
+	*key = NULL;
+	if (!ukey)
+		return 0;
+	*key = kmalloc(MAXWORD_LEN, GFP_KERNEL);
+	if (!*key)
+		return -ENOMEM;
+	len = strncpy_from_user(*key, ukey, MAXWORD_LEN);
+	if (len < 0)
+		return len;
+	if (len == MAXWORD_LEN)
+		return -ENAMETOOLONG;
+	return 0;
+}
+
+/**
+ * shards_init - set up the sharding of an output file
+ * @sh: shards
+ * @marg: user arguments
+ * @name: output file name
+ * @mode: permissions of every shard
+ * @open_flags: extra open flags of every shard
+ * @flags: user flags
+ *
+ * returns 0 if successful else negative value.
+ */
+	static int
+shards_init(xshards_t *sh, margs_t *marg, const char *name, mode_t mode,
+		int open_flags, int flags)
+{
+	const char __user	*ukey;
+	u_int			k;
+	int			ret;
+
+	if (!marg->max_shards || marg->max_shards > XSHARD_MAX ||
+			marg->nr_shard_keys > XSHARD_MAX ||
+			(!marg->shard_size && !marg->nr_shard_keys))
+		return -EINVAL;
+	if (!access_ok(VERIFY_WRITE, marg->shards,
+				marg->max_shards * sizeof(xshard_t)) ||
+			!access_ok(VERIFY_WRITE, marg->nr_shards, sizeof(u_int)))
+		return -EFAULT;
+
+	sh->name       = name;
+	sh->mode       = mode;
+	sh->open_flags = open_flags;
+	sh->flags      = flags;
+	sh->size       = marg->shard_size;
+	sh->max        = marg->max_shards;
+
+	sh->filps = kcalloc(sh->max, sizeof(struct file *), GFP_KERNEL);
+	sh->man   = vzalloc(sh->max * sizeof(xshard_t));
+	if (!sh->filps || !sh->man)
+		return -ENOMEM;
+
+	if (!marg->nr_shard_keys)
+		return 0;
+	sh->keys = kcalloc(marg->nr_shard_keys, sizeof(char *), GFP_KERNEL);
+	if (!sh->keys)
+		return -ENOMEM;
+	for (k = 0; k < marg->nr_shard_keys; k++) {
+		if (get_user(ukey, &marg->shard_keys[k]))
+			return -EFAULT;
+		if (!ukey)
+			return -EINVAL;
+		sh->nr_keys = k + 1;	/* freed with the rest even if the copy fails */
+		ret = copy_key(ukey, &sh->keys[k]);
+		if (ret < 0)
+			return ret;
+		/* boundaries are crossed in order */
+		if (k && record_cmp(sh->keys[k - 1], sh->keys[k], flags) >= 0)
+			return -EINVAL;
+	}
+	return 0;
+}
+
+/**
+ * shards_release - close the shards after the first and free the state
+ * @sh: shards
+ * @remove: remove the shard files too
+ *
+ * The first shard is the output file of the merge and is closed with it.
+ */
+	static void
+shards_release(xshards_t *sh, int remove)
+{
+	u_int k;
+
+	for (k = 1; k < sh->nr; k++) {
+		if (remove)
+			SAFE_REMOVE(sh->filps[k]);
+		SAFE_FILPCLOSE(sh->filps[k]);
+	}
+	for (k = 0; k < sh->nr_keys; k++)
+		SAFE_FREE(sh->keys[k]);
+	SAFE_FREE(sh->keys);
+	SAFE_FREE(sh->filps);
+	vfree(sh->man);
+	sh->man = NULL;
+}
+
+/**
+ * open_shard - create the next shard file
+ * @sh: shards
+ *
+ * Every shard is created exclusively with the permissions of the output.
+ *
+ * returns the opened file or ERR_PTR.
+ */
+	static struct file *
+open_shard(xshards_t *sh)
+{
+	xshard_t	*ent;
+	struct file	*filp;
+	int		len;
+
+	if (sh->nr == sh->max)
+		return ERR_PTR(-ENOBUFS);	/* manifest is full */
+	ent = &sh->man[sh->nr];
+	len = snprintf(ent->name, XSHARD_NAME_LEN, "%s.%u", sh->name, sh->nr);
+	if (len >= XSHARD_NAME_LEN)
+		return ERR_PTR(-ENAMETOOLONG);
+
+	filp = filp_open(ent->name,
+			O_CREAT | O_RDWR | O_TRUNC | O_EXCL | sh->open_flags,
+			sh->mode);
+	if (IS_ERR(filp))
+		return filp;
+	sh->filps[sh->nr++] = filp;
+	return filp;
+}
+
+/**
+ * next_shard - finish the current shard and continue in a new one
+ * @xs: output stream
+ *
+ * returns 0 if successful else negative value.
+ */
+	static int
+next_shard(xstream_t *xs)
+{
+	xshards_t	*sh = xs->sh;
+	struct file	*filp;
+	int		ret;
+
+	ret = xstream_flush(xs);
+	if (ret < 0)
+		return ret;
+	filp = open_shard(sh);
+	if (IS_ERR(filp))
+		return PTR_ERR(filp);
+
+	xstream_release(xs);
+	ret = xstream_init(xs, filp, sh->flags, 1);
+	xs->sh = sh;
+	return ret;
+}
+
+/**
+ * shard_records - write output, rolling over to a new shard where the
+ *                 current one is full or a shard key is reached
+ * @xs: output stream
+ * @buf: output data, whole records
+ * @len: length of output data
+ *
+ * A shard is never left empty: a record longer than the shard size gets a
+ * shard of its own, and keys no record falls between are skipped.
+ *
+ * returns @len if successful else negative value.
+ */
+	static int
+shard_records(xstream_t *xs, const char *buf, int len)
+{
+	xshards_t	*sh = xs->sh;
+	xshard_t	*cur = &sh->man[sh->nr - 1];
+	char		record[XSHARD_KEY_LEN];
+	int		start = 0, i, n, k, roll;
+	int		ret;
+
+	for (i = 0; i < len; i = n) {
+		for (n = i; n < len && buf[n] != '\n'; n++)
+			;
+		n++;
+		k = min(n - i - 1, XSHARD_KEY_LEN - 1);
+		memcpy(record, buf + i, k);
+		record[k] = '\0';
+
+		roll = sh->size && cur->bytes + (n - i) > sh->size;
+		while (sh->next_key < sh->nr_keys &&
+				record_cmp(record, sh->keys[sh->next_key],
+					sh->flags) >= 0) {
+			sh->next_key++;
+			roll = 1;
+		}
+
+		if (roll && cur->records) {
+			ret = xstream_write(xs, buf + start, i - start);
+			if (ret < 0)
+				return ret;
+			ret = next_shard(xs);
+			if (ret < 0)
+				return ret;
+			cur   = &sh->man[sh->nr - 1];
+			start = i;
+		}
+		if (!cur->records)
+			strcpy(cur->first, record);
+		strcpy(cur->last, record);
+		cur->bytes += n - i;
+		cur->records++;
+	}
+
+	ret = xstream_write(xs, buf + start, len - start);
+	if (ret < 0)
+		return ret;
+	return len;
+}
+
+/**
+ * write_chunk - append @len bytes of @buf, whole records, to the output
+ * @xs: output stream
+ * @buf: data to write
+ * @len: length of data
+ *
+ * Index entries, if any, are taken before the data is written. A sharded
+ * output is split over its shards on record boundaries.
+ *
+ * returns @len if successful else negative value.
+ */
+	static int
+write_chunk(xstream_t *xs, const char *buf, int len)
+{
+	int ret;
+
+	if (xs->sh)
+		return shard_records(xs, buf, len);
+	if (xs->ix) {
+		ret = index_records(xs->ix, buf, len, xs->pos);
+		if (ret < 0)
+			return ret;
+	}
+	return xstream_write(xs, buf, len);
+}
+
+/**
+ * fget_files - take references on the already opened files of a merge
+ * @marg: user arguments
+ * @in1: set to input file1
+ * @in2: set to input file2
+ * @out: set to output file
+ *
+ * Inputs and output can also be pipes or sockets, inputs are read until
+ * end of file.
+ *
+ * returns 0 if successful else negative value.
+ */
+	static int
+fget_files(margs_t *marg, struct file **in1, struct file **in2,
+		struct file **out)
+{
+	*in1 = fget(marg->infd1);
+	*in2 = fget(marg->infd2);
+	*out = fget(marg->outfd);
+	if (!*in1 || !*in2 || !*out)
+		return -EBADF;
+
+	if (!((*in1)->f_mode & FMODE_READ) || !((*in2)->f_mode & FMODE_READ) ||
+			!((*out)->f_mode & FMODE_WRITE))
+		return -EBADF;
+
+	/*
+	 * output can't be an input, and a pipe can't feed both inputs.
+	 */
+	if (file_inode(*in1) == file_inode(*out) ||
+			file_inode(*in2) == file_inode(*out))
+		return -EINVAL;
+	if (file_inode(*in1) == file_inode(*in2) &&
+			!((*in1)->f_mode & FMODE_PREAD))
+		return -EINVAL;
+	return 0;
+}
+
+/**
+ * record_at - extract the first record starting at or after @off
+ * @filp: input file
+ * @off: file offset, re-synced past the next '\n' unless 0
+ * @buf: scratch buffer of RECBUF_LEN bytes
+ * @record: record placeholder
+ * @start: set to the file offset of the record
+ *
+ * returns length of the record like getstring, 0 if no record starts
+ * before end of file.
+ */
+	static int
+record_at(struct file *filp, loff_t off, char *buf, char *record,
+		loff_t *start)
+{
+	loff_t	from = off ? off - 1 : 0;
+	int	bytes, i = 0, j;
+
+	bytes = kernel_read(filp, from, buf, RECBUF_LEN);
+	if (bytes < 0)
+		return bytes;
+	if (off) {
+		while (i < bytes && buf[i] != '\n')
+			i++;
+		i++;
+	}
+	if (i >= bytes)
+		return 0;
+
+	for (j = i; j < bytes && buf[j] != '\n'; j++)
+		;
+	if (j - i >= MAXWORD_LEN)
+		return -EINVAL;
+	memcpy(record, buf + i, j - i);
+	record[j - i] = '\0';
+	*start = from + i;
+	return j - i + 1;
+}
+
+/**
+ * seek_record - binary search a sorted file over its record boundaries
+ * @filp: sorted file
+ * @size: size of the file
+ * @key: key to search
+ * @flags: user flags
+ * @upper: find the first record greater than @key instead of the first
+ *         record not less than @key
+ * @before: set to the record preceding the found one, "" if none
+ *          (may be NULL)
+ * @off: set to the offset of the found record, @size if none
+ *
+ * returns 0 if successful else negative value.
+ */
+	static int
+seek_record(struct file *filp, loff_t size, const char *key, int flags,
+		int upper, char *before, loff_t *off)
+{
+	char	*buf, record[MAXWORD_LEN];
+	loff_t	lo = 0, hi = size, mid, start;
+	int	len, cmp, ret = 0;
+
+	buf = kmalloc(RECBUF_LEN, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	if (before)
+		before[0] = '\0';
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		len = record_at(filp, mid, buf, record, &start);
+		if (len < 0) {
+			ret = len;
+			goto out;
+		}
+		/* no record starts in [mid, hi) */
+		if (!len || start >= hi) {
+			hi = mid;
+			continue;
+		}
+		cmp = record_cmp(record, key, flags);
+		if (cmp < 0 || (upper && !cmp)) {
+			lo = start + len;
+			if (before)
+				memcpy(before, record, len);
+		} else {
+			hi = start;
+		}
+	}
+	/* last record without '\n' */
+	*off = min(lo, size);
+out:
+	kfree(buf);
+	return ret;
+}
+
+/**
+ * xstream_range - restrict an input stream to the records in [@lo, @hi)
+ * @xs: input stream of a sorted file
+ * @lo: lower key bound, NULL if none
+ * @hi: upper key bound, NULL if none
+ * @flags: user flags
+ *
+ * Both bounds are binary searched, so only the records of the range are
+ * ever read by the merge.
+ *
+ * returns 0 if successful else negative value.
+ */
+	static int
+xstream_range(xstream_t *xs, const char *lo, const char *hi, int flags)
+{
+	loff_t	size, off;
+	int	ret;
+
+	if (!xs->filp)
+		return 0;
+	/* pipes can't be searched */
+	if (xs->win)
+		return -ESPIPE;
+
+	size = file_inode(xs->filp)->i_size;
+	if (lo) {
+		ret = seek_record(xs->filp, size, lo, flags, 0, NULL, &off);
+		if (ret < 0)
+			return ret;
+		/* an already opened file may start further on */
+		xs->pos = max(xs->pos, off);
+		xs->dropped = round_down(xs->pos, PAGE_SIZE);
+	}
+	if (hi) {
+		ret = seek_record(xs->filp, size, hi, flags, 0, NULL, &xs->end);
+		if (ret < 0)
+			return ret;
+	}
+	if (xs->end < xs->pos)
+		xs->end = xs->pos;
+	return 0;
+}
+
+/**
+ * open_incremental - prepare the incremental merge of a sorted delta into
+ *                    an existing sorted target
+ * @target: target file name
+ * @delta: delta file name
+ * @flags: user flags
+ * @tgt: set to the target, opened for read and write
+ * @dlt: set to the delta
+ * @tmp: set to a copy of the target from @split on, NULL if the delta
+ *       sorts entirely after the target
+ * @split: set to the offset from where the target is rewritten
+ * @size: set to the size of the target
+ * @prev: set to the last record of the untouched prefix of the target
+ *
+ * The target prefix before the first record the delta interleaves with
+ * is left alone. The rest is saved in "<target>.xmerge" which is merged
+ * with the delta back into the target from @split on.
+ *
+ * returns 0 if successful else negative value.
+ */
+	static int
+open_incremental(const char *target, const char *delta, int flags,
+		struct file **tgt, struct file **dlt, struct file **tmp,
+		loff_t *split, loff_t *size, char *prev)
+{
+	char		*buf = NULL, *name = NULL, key[MAXWORD_LEN];
+	loff_t		start, pos;
+	ssize_t		bytes;
+	int		ret;
+
+	*dlt = filp_open(delta, O_RDONLY, 0);
+	if (IS_ERR(*dlt))
+		return PTR_ERR(*dlt);
+	*tgt = filp_open(target, O_RDWR, 0);
+	if (IS_ERR(*tgt))
+		return PTR_ERR(*tgt);
+
+	if (!S_ISREG(file_inode(*dlt)->i_mode) ||
+			!S_ISREG(file_inode(*tgt)->i_mode))
+		return -EPERM;
+	if (file_inode(*dlt)->i_sb != file_inode(*tgt)->i_sb)
+		return -EACCES;
+	if (file_inode(*dlt) == file_inode(*tgt))
+		return -EINVAL;
+
+	*size  = file_inode(*tgt)->i_size;
+	*split = *size;
+
+	buf = kmalloc(RECBUF_LEN, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	/* empty delta, nothing to merge */
+	ret = record_at(*dlt, 0, buf, key, &start);
+	if (ret <= 0)
+		goto out;
+
+	ret = seek_record(*tgt, *size, key, flags, 1, prev, split);
+	if (ret < 0)
+		goto out;
+
+	if (*split == *size) {
+		/*
+		 * pure append, just terminate the last record of the target.
+		 */
+		if (*size) {
+			bytes = kernel_read(*tgt, *size - 1, buf, 1);
+			if (bytes != 1) {
+				ret = bytes < 0 ? bytes : -EIO;
+				goto out;
+			}
+			if (buf[0] != '\n') {
+				bytes = kernel_write(*tgt, "\n", 1, *size);
+				if (bytes != 1) {
+					ret = bytes < 0 ? bytes : -EIO;
+					goto out;
+				}
+				*split = *size + 1;
+			}
+		}
+		ret = 0;
+		goto out;
+	}
+
+	name = kasprintf(GFP_KERNEL, "%s.xmerge", target);
+	if (!name) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	*tmp = filp_open(name, O_CREAT | O_RDWR | O_EXCL, S_IRUSR | S_IWUSR);
+	if (IS_ERR(*tmp)) {
+		ret = PTR_ERR(*tmp);
+		goto out;
+	}
+
+	for (pos = *split; pos < *size; pos += bytes) {
+		bytes = vfs_copy_file_range(*tgt, pos, *tmp, pos - *split,
+				*size - pos, 0);
+		if (bytes <= 0) {
+			ret = bytes < 0 ? bytes : -EIO;
+			goto out;
+		}
+	}
+	ret = 0;
+out:
+	kfree(name);
+	kfree(buf);
+	return ret;
+}
+
+/**
+ * restore_target - undo a failed incremental merge
+ * @tgt: target
+ * @tmp: saved target suffix, NULL if none
+ * @split: offset from where the target was rewritten
+ * @size: original size of the target
+ *
+ * The saved suffix is copied back from @split on and the target is cut
+ * back to its original size, which also drops the '\n' a pure append
+ * terminated the target with.
+ *
+ * returns 0 if successful else negative value.
+ */
+	static int
+restore_target(struct file *tgt, struct file *tmp, loff_t split,
+		loff_t size)
+{
+	loff_t	pos;
+	ssize_t	bytes;
+
+	if (tmp) {
+		for (pos = split; pos < size; pos += bytes) {
+			bytes = vfs_copy_file_range(tmp, pos - split, tgt, pos,
+					size - pos, 0);
+			if (bytes <= 0)
+				return bytes < 0 ? bytes : -EIO;
+		}
+	}
+	if (file_inode(tgt)->i_size != size)
+		return vfs_truncate(&tgt->f_path, size);
+	return 0;
+}
+
+/**
+ * These macros are just avoiding the duplicate code in the function
+ * read_and_merge_files. some of the variables are common to the code,
+ * so not passing explicitly in the code.
+ */
+#define APPEND_REMAINING_FILE(_xs_, _src_buffer_, _src_len_, _chunk_,     \
+		_second_, _dest_,                                         \
+		_flags_, _err_, _prev_, _count_, _used_)		              \
+do {		  										                                            \
+	while((_src_len_) > 0) {							                              \
+		bytes = (_second_) ?                                                \
+			merge_records(NULL, -1, (_chunk_), (_src_len_),             \
+				(_dest_), (_flags_), &(_err_), (_prev_),            \
+				&(_count_), NULL, &(_used_)) :                      \
+			merge_records((_chunk_), (_src_len_), NULL, -1,             \
+				(_dest_), (_flags_), &(_err_), (_prev_),            \
+				&(_count_), &(_used_), NULL);                       \
+		ret = write_chunk(&xout, (_dest_), bytes);			                  \
+		if (ret < 0) {									                                    \
+			MDBG;									                                            \
+			goto cleanup;								                                      \
+		}										                                                \
+		if ((_err_) == -1) {                                                \
+			ret = -1;                                                   \
+			goto cleanup;                                               \
+		}                                                                   \
+		xstream_consume((_xs_), (_used_));                                  \
+		bytes = read_chunk((_xs_), (_src_buffer_), &(_chunk_));             \
+		if (bytes < 0) {								                                    \
+			MDBG; 									                                          \
+			ret = bytes;								                                      \
+			goto cleanup;								                                      \
+		}	else {								                                            \
+			(_src_len_) = bytes;                                              \
+		}                                                                   \
+	}											                                                \
+} while(0)
+
+#define CHECK_PTR_ERR(_p_)			\
+	do {	  					              \
+		if (IS_ERR((_p_))) {			  \
+			MDBG;				              \
+			ret = PTR_ERR((_p_));		  \
+			goto cleanup;			        \
+		}					                  \
+	} while(0)
+
+#define CHECK_FILEP(_filep_)		\
+	do {	  					              \
+		if (!(_filep_)) {			      \
+			MDBG;				              \
+			ret = -1;			            \
+			goto cleanup;			        \
+		}					                  \
+		CHECK_PTR_ERR((_filep_));		\
+	} while(0)
+
+/**
+ * read_and_merge_files - pulp of the implementation. reads two sorted or partially
+ *                        input files by max BUFFER_SIZE chunk, merge them and put 
+ *                        into placeholder output buffer. flush the output buffer
+ *                        content to the output file.
+ *                        does also all possible checks on input arguments and validity
+ *                        of the user intended merge operation.
+ * @arg: arguments passed from user
+ *
+ * returns number of bytes written if successful else negative value.
+ */                       
+	long
+read_and_merge_files(void *arg)
+{
+	struct file	      *infilp1 = NULL, *infilp2 = NULL, *outfilp = NULL;
+	void 		          *inbuf1  = NULL, *inbuf2  = NULL, *outbuf  = NULL;
+	xstream_t         xin1, xin2, xout;
+	char              *chunk1 = NULL, *chunk2 = NULL;
+	int               open_flags = 0;
+	struct filename   *infile1 = NULL, *infile2 = NULL, *outfile = NULL;
+	struct filename   *idxfile = NULL;
+	xindex_t          ix;
+	xshards_t         sh;
+	char              *lo_key = NULL, *hi_key = NULL;
+	int 		          bytes = -1;
+	margs_t 	        marg;
+	loff_t		          insize1, insize2;
+	long		            ret = 0;
+	int		            flags = 0;
+	int 		          src_len1 = 0, src_len2 = 0;
+	int               used1, used2;
+	u_int             shard;
+	u_int             count = 0;
+	mode_t 		        mode = 0;
+	int               merge_err = 0;
+	char              prev[MAXWORD_LEN] = "";
+	loff_t            out_start = 0, out_size = 0;
+	loff_t            written = 0;
+	int               tgt_saved = 0;
+
+	rec_total = 0;
+	memset(&ix, 0, sizeof(ix));
+	memset(&sh, 0, sizeof(sh));
+	memset(&xin1, 0, sizeof(xin1));
+	memset(&xin2, 0, sizeof(xin2));
+	memset(&xout, 0, sizeof(xout));
+
+	if (copy_from_user(&marg, arg, sizeof(margs_t))) {
+		MDBG;
+		ret = -EFAULT;
+		goto cleanup;
+	}
+
+	flags	= marg.flags;
+
+	/*
+	 * direct I/O already bypasses the page cache, nothing to drop behind.
+	 */
+	if ((flags & FLAG_DIRECT_IO) && (flags & FLAG_DROP_BEHIND)) {
+		MDBG;
+		ret = -EINVAL;
+		goto cleanup;
+	}
+	/*
+	 * LZ4 only picks the format of a compressed output.
+	 */
+	if ((flags & FLAG_LZ4) && !(flags & FLAG_COMPRESS)) {
+		MDBG;
+		ret = -EINVAL;
+		goto cleanup;
+	}
+	/*
+	 * compressed data is streamed through zlib, not read in place, and
+	 * already opened files keep the open flags they were opened with.
+	 */
+	if ((flags & FLAG_DIRECT_IO) &&
+			(flags & (FLAG_COMPRESS | FLAG_DECOMPRESS | FLAG_FD_ARGS))) {
+		MDBG;
+		ret = -EINVAL;
+		goto cleanup;
+	}
+	/*
+	 * incremental merge binary searches and rewrites a plain target file.
+	 */
+	if ((flags & FLAG_INCREMENTAL) &&
+			(flags & (FLAG_DIRECT_IO | FLAG_COMPRESS |
+				  FLAG_DECOMPRESS | FLAG_FD_ARGS))) {
+		MDBG;
+		ret = -EINVAL;
+		goto cleanup;
+	}
+	if (flags & FLAG_DIRECT_IO)
+		open_flags |= O_DIRECT;
+
+	/*
+	 * index offsets are offsets of a plain output file merged as a whole.
+	 */
+	if ((flags & FLAG_INDEX) &&
+			(flags & (FLAG_COMPRESS | FLAG_FD_ARGS | FLAG_INCREMENTAL))) {
+		MDBG;
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	/*
+	 * key range binary searches plain sorted inputs.
+	 */
+	if ((flags & FLAG_KEY_RANGE) &&
+			(flags & (FLAG_DIRECT_IO | FLAG_DECOMPRESS | FLAG_INCREMENTAL))) {
+		MDBG;
+		ret = -EINVAL;
+		goto cleanup;
+	}
+	/*
+	 * at most one set operation. set operations and counts make no sense
+	 * for an incremental target, and a counted output is not sorted by
+	 * record any more, so it can't be indexed or split by key.
+	 */
+	if (((flags & FLAG_SET_OPS) & ((flags & FLAG_SET_OPS) - 1)) ||
+			((flags & FLAG_SET_OPS) && (flags & FLAG_INCREMENTAL)) ||
+			((flags & FLAG_COUNT_UNIQ) &&
+			 ((flags & FLAG_INDEX) ||
+			  ((flags & FLAG_SHARD) && marg.nr_shard_keys)))) {
+		MDBG;
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	/*
+	 * shards are new files created next to a named output.
+	 */
+	if ((flags & FLAG_SHARD) &&
+			(flags & (FLAG_INDEX | FLAG_FD_ARGS | FLAG_INCREMENTAL))) {
+		MDBG;
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	if (flags & FLAG_KEY_RANGE) {
+		ret = copy_key(marg.lo_key, &lo_key);
+		if (ret < 0)
+			goto cleanup;
+		ret = copy_key(marg.hi_key, &hi_key);
+		if (ret < 0)
+			goto cleanup;
+	}
+
+	if (!access_ok(VERIFY_WRITE, marg.records, sizeof((marg.records)))) {
+		MDBG;
+		ret = -EFAULT;
+		goto cleanup;
+	}
+
+	if (flags & FLAG_FD_ARGS) {
+		ret = fget_files(&marg, &infilp1, &infilp2, &outfilp);
+		if (ret < 0)
+			goto cleanup;
+		goto files_opened;
+	}
+
+	if (!access_ok(VERIFY_READ, marg.infile1, sizeof((marg.infile1))) ||
+			!access_ok(VERIFY_READ, marg.outfile, sizeof((marg.outfile)))) {
+		MDBG;
+		ret = -EFAULT;
+		goto cleanup;
+	}
+
+	infile1 = getname((const char __user *)marg.infile1);
+	CHECK_PTR_ERR(infile1);
+	outfile = getname((const char __user *)marg.outfile);
+	CHECK_PTR_ERR(outfile);
+
+	/*
+	 * incremental: outfile is the existing sorted target, infile1 the
+	 * sorted delta. The suffix of the target from the split point is
+	 * merged with the delta as input file1.
+	 */
+	if (flags & FLAG_INCREMENTAL) {
+		printk("Target Filename:%s\n", outfile->name);
+		printk("Delta Filename:%s\n", infile1->name);
+		ret = open_incremental(outfile->name, infile1->name, flags,
+				&outfilp, &infilp2, &infilp1,
+				&out_start, &out_size, prev);
+		if (ret < 0)
+			goto cleanup;
+		tgt_saved = 1;
+		goto files_opened;
+	}
+
+	if (!access_ok(VERIFY_READ, marg.infile2, sizeof((marg.infile2)))) {
+		MDBG;
+		ret = -EFAULT;
+		goto cleanup;
+	}
+	infile2 = getname((const char __user *)marg.infile2);
+	CHECK_PTR_ERR(infile2);
+
+	if (flags & FLAG_INDEX) {
+		if (!access_ok(VERIFY_READ, marg.idxfile, sizeof((marg.idxfile)))) {
+			MDBG;
+			ret = -EFAULT;
+			goto cleanup;
+		}
+		idxfile = getname((const char __user *)marg.idxfile);
+		CHECK_PTR_ERR(idxfile);
+	}
+
+	printk("Input Filename:%s\n", infile1->name);
+	printk("Input Filename:%s\n", infile2->name);
+	printk("Output Filename:%s\n", outfile->name);
+
+	if (!strcmp(infile1->name,infile2->name) ||
+			!strcmp(infile1->name, outfile->name) ||
+			!strcmp(infile2->name,outfile->name))  {
+		MDBG;
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	/*
+	 * open I/P files in read only mode.
+	 */ 
+	infilp1 = filp_open(infile1->name, O_RDONLY | open_flags, 0);
+	CHECK_FILEP(infilp1);
+
+	infilp2 = filp_open(infile2->name, O_RDONLY | open_flags, 0);
+	CHECK_FILEP(infilp2);
+	/*
+	 * merge should be allowed only on regular files.
+	 */
+#define inode_mode(_filep_) ((_filep_)->f_inode->i_mode)
+#define _mode(T,_mode_)  ((S_IRWX ## T) & (_mode_))
+	if (!S_ISREG(inode_mode(infilp1)) || !S_ISREG(inode_mode(infilp2))) {
+		ret = -EPERM;
+		goto cleanup;
+	} else {
+		/*
+		 * mode of output file will be no more permissive than the
+		 * input file permissions.
+		 * e.g. if infile1 : 0555, infile2 : 0400
+		 *      then outfile permissions : 0400
+		 */        
+		mode |= _mode(U,inode_mode(infilp1)) > _mode(U,inode_mode(infilp2))? 
+			_mode(U,inode_mode(infilp2)):
+			_mode(U,inode_mode(infilp1));
+
+		mode |= _mode(G,inode_mode(infilp1)) > _mode(G,inode_mode(infilp2))? 
+			_mode(G,inode_mode(infilp2)):
+			_mode(G,inode_mode(infilp1));
+
+		mode |= _mode(O,inode_mode(infilp1)) > _mode(O,inode_mode(infilp2))? 
+			_mode(O,inode_mode(infilp2)):
+			_mode(O,inode_mode(infilp1));
+		printk ("Output file mode: %o\n", mode);
+	}
+
+	/*
 	 * create output file in exclusive mode. don't overwrite if file is already present.
+	 * a sharded output starts with its first shard, all shards get the
+	 * same mode.
 	 */
-	outfilp = filp_open(outfile->name, O_CREAT | O_RDWR | O_TRUNC | O_EXCL, mode);
+	if (flags & FLAG_SHARD) {
+		ret = shards_init(&sh, &marg, outfile->name, mode, open_flags,
+				flags);
+		if (ret < 0)
+			goto cleanup;
+		outfilp = open_shard(&sh);
+	} else {
+		outfilp = filp_open(outfile->name,
+				O_CREAT | O_RDWR | O_TRUNC | O_EXCL | open_flags, mode);
+	}
 	CHECK_FILEP(outfilp);
 
 	if(!S_ISREG(inode_mode(outfilp))) {
@@ -513,8 +2721,25 @@ read_and_merge_files(void *arg)
 		goto cleanup;
 	}
 
+	/*
+	 * index sidecar gets the same permissions as the output file.
+	 */
+	if (flags & FLAG_INDEX) {
+		ix.filp = filp_open(idxfile->name,
+				O_CREAT | O_WRONLY | O_TRUNC | O_EXCL, mode);
+		CHECK_FILEP(ix.filp);
+		ix.interval = (loff_t)(marg.idx_interval ? marg.idx_interval :
+				XIDX_DEF_INTERVAL) << 10;
+		ix.ents = kmalloc(XIDX_BATCH * sizeof(xidx_entry_t), GFP_KERNEL);
+		if (ix.ents == NULL) {
+			ret = -ENOMEM;
+			goto cleanup;
+		}
+	}
+
+files_opened:
 #define file_size(_filep_) ((_filep_)->f_inode->i_size)
-	insize1 = file_size(infilp1);
+	insize1 = infilp1 ? file_size(infilp1) : 0;
 	insize2 = file_size(infilp2);
 	if (insize1 < 0 || insize2 < 0) {
 		ret = -EBADF;
@@ -527,30 +2752,80 @@ read_and_merge_files(void *arg)
 		goto cleanup;                 \
 	}
 
-	if (insize1 > 0) { 
+	/*
+	 * already opened files are merged from their current offset, like
+	 * read(2) and write(2) would.
+	 */
+	if (!(flags & FLAG_FD_ARGS)) {
+		/* an incremental merge has no saved target suffix to append to */
+		if (infilp1)
+			infilp1->f_pos = 0;	/* start offset */
+		infilp2->f_pos = 0;		/* start offset */
+		outfilp->f_pos = 0;		/* start offset */
+	}
+
+	ret = xstream_init(&xin1, infilp1, flags, 0);
+	if (ret < 0)
+		goto cleanup;
+	ret = xstream_init(&xin2, infilp2, flags, 0);
+	if (ret < 0)
+		goto cleanup;
+	ret = xstream_init(&xout, outfilp, flags, 1);
+	if (ret < 0)
+		goto cleanup;
+	/*
+	 * compressed and pipe streams go on from f_pos by themselves.
+	 */
+	if (flags & FLAG_FD_ARGS) {
+		if (!xin1.win)
+			xin1.pos = infilp1->f_pos;
+		if (!xin2.win)
+			xin2.pos = infilp2->f_pos;
+		if (!xout.zs && !xout.stream)
+			out_start = outfilp->f_pos;
+	}
+	xout.pos = out_start;
+	/* the untouched prefix of an incremental target stays cached */
+	if (!xout.zs)
+		xout.dropped = xout.flushed = round_down(out_start, PAGE_SIZE);
+	if (ix.filp)
+		xout.ix = &ix;
+	if (sh.nr)
+		xout.sh = &sh;
+
+	if (flags & FLAG_KEY_RANGE) {
+		ret = xstream_range(&xin1, lo_key, hi_key, flags);
+		if (ret < 0)
+			goto cleanup;
+		ret = xstream_range(&xin2, lo_key, hi_key, flags);
+		if (ret < 0)
+			goto cleanup;
+	}
+
+	/*
+	 * windowed inputs (O_DIRECT, compressed, pipes) are read in their own
+	 * window.
+	 */
+	if (!xin1.win) { 
 		inbuf1  = kmalloc(sizeof(char)*BUFFER_SIZE, GFP_KERNEL);
 		BUF_ALLOCD_CHECK(inbuf1);
 	}
 
-	if (insize2 > 0) {
+	if (!xin2.win) {
 		inbuf2  = kmalloc(sizeof(char)*BUFFER_SIZE, GFP_KERNEL);
 		BUF_ALLOCD_CHECK(inbuf2);
 	}
 
-	if (insize1 || insize2) { 
-		outbuf  = kmalloc(2*sizeof(char)*BUFFER_SIZE, GFP_KERNEL);
-		BUF_ALLOCD_CHECK(outbuf);
-	}
-
+	outbuf  = kmalloc(2*sizeof(char)*BUFFER_SIZE, GFP_KERNEL);
+	BUF_ALLOCD_CHECK(outbuf);
 
-	infilp1->f_pos = 0;		/* start offset */
-	infilp2->f_pos = 0;		/* start offset */
-	outfilp->f_pos = 0;		/* start offset */
-
-	while ((infilp1->f_pos < insize1) && (infilp2->f_pos < insize2)) {
+	/*
+	 * inputs are read until end of file, i_size of a compressed input
+	 * is not the size of its data.
+	 */
+	while (1) {
 		/*read chunk from input file1 */
-		bytes = kernel_read(infilp1, infilp1->f_pos, inbuf1, BUFFER_SIZE);
-		bytes = adjusted_bytes(inbuf1, bytes);
+		bytes = read_chunk(&xin1, inbuf1, &chunk1);
 		if (bytes < 0) {
 			ret = bytes;
 			goto cleanup;
@@ -559,8 +2834,7 @@ read_and_merge_files(void *arg)
 		}
 
 		/* read chunk from input file2 */
-		bytes = kernel_read(infilp2, infilp2->f_pos, inbuf2, BUFFER_SIZE);
-		bytes = adjusted_bytes(inbuf2, bytes);
+		bytes = read_chunk(&xin2, inbuf2, &chunk2);
 		if (bytes < 0) {
 			ret = bytes;
 			goto cleanup;
@@ -568,14 +2842,18 @@ read_and_merge_files(void *arg)
 			src_len2 = bytes;
 		}
 
+		if (!src_len1 || !src_len2)
+			break;
+
 		if (src_len1 + src_len2 > 2 * BUFFER_SIZE) {
 			ret = -1;
 			goto cleanup;
 		}
 		/* merge the records and put into outbuf */
-		bytes = merge_records(inbuf1, src_len1, inbuf2, src_len2,
-				outbuf, flags, &merge_err, prev);
-		ret = kernel_write(outfilp, outbuf, bytes, outfilp->f_pos);	
+		bytes = merge_records(chunk1, src_len1, chunk2, src_len2,
+				outbuf, flags, &merge_err, prev, &count,
+				&used1, &used2);
+		ret = write_chunk(&xout, outbuf, bytes);
 		if (ret < 0) {
 			goto cleanup;
 		}
@@ -585,33 +2863,106 @@ read_and_merge_files(void *arg)
 			goto cleanup;
 		}
 
-		outfilp->f_pos += ret;
-		infilp1->f_pos += src_len1;
-		infilp2->f_pos += src_len2;	
+		xstream_consume(&xin1, used1);
+		xstream_consume(&xin2, used2);
 	}
 
 	/*
 	 * append remaining recs in correct fashion.
 	 */ 
-	if ((infilp2->f_pos >= insize2) && (infilp1->f_pos < insize1)) {
-		APPEND_REMAINING_FILE(infilp1, insize1, inbuf1, src_len1,
-				outbuf, flags, merge_err, prev);
+	APPEND_REMAINING_FILE(&xin1, inbuf1, src_len1, chunk1, 0,
+			outbuf, flags, merge_err, prev, count, used1);
+	APPEND_REMAINING_FILE(&xin2, inbuf2, src_len2, chunk2, 1,
+			outbuf, flags, merge_err, prev, count, used2);
+
+	/*
+	 * the count of the last unique record is known only now.
+	 */
+	if ((flags & FLAG_COUNT_UNIQ) && count) {
+		bytes = 0;
+		append_count(prev, count, outbuf, &bytes);
+		ret = write_chunk(&xout, outbuf, bytes);
+		if (ret < 0)
+			goto cleanup;
 	}
 
-	if ((infilp1->f_pos >= insize1) && (infilp2->f_pos < insize2)) {
-		APPEND_REMAINING_FILE(infilp2, insize2, inbuf2, src_len2,
-				outbuf, flags, merge_err, prev);
+	ret = xstream_flush(&xout);
+	if (ret < 0)
+		goto cleanup;
+
+	/*
+	 * offsets of already opened files are left after the data merged.
+	 * like write(2), data after it is the caller's to truncate.
+	 */
+	if (flags & FLAG_FD_ARGS) {
+		if (!xout.zs && !xout.stream)
+			outfilp->f_pos = xout.pos;
+		if (!xin1.win)
+			infilp1->f_pos = min(xin1.pos, file_size(infilp1));
+		if (!xin2.win)
+			infilp2->f_pos = min(xin2.pos, file_size(infilp2));
+	}
+	if (ix.filp) {
+		ret = xindex_finish(&ix, flags);
+		if (ret < 0)
+			goto cleanup;
 	}
 
-	bytes = outfilp->f_pos;
-	ret = bytes;
+	/*
+	 * an incremental merge that skipped records leaves a stale tail.
+	 */
+	if ((flags & FLAG_INCREMENTAL) && xout.pos < out_size) {
+		ret = vfs_truncate(&outfilp->f_path, xout.pos);
+		if (ret < 0)
+			goto cleanup;
+	}
+	drop_behind(&xin1, min(xin1.end, insize1), 1);
+	drop_behind(&xin2, min(xin2.end, insize2), 1);
+
+	written = xout.pos - out_start;
+	if (sh.nr) {
+		for (written = 0, shard = 0; shard < sh.nr; shard++)
+			written += sh.man[shard].bytes;
+		if (copy_to_user((void __user *)marg.shards, sh.man,
+					sh.nr * sizeof(xshard_t)) ||
+				put_user(sh.nr, marg.nr_shards)) {
+			ret = -EFAULT;
+			goto cleanup;
+		}
+	}
+	ret = written;
 
 cleanup:
+	/*
+	 * a failed incremental merge puts the target back as it was. keep the
+	 * saved target suffix if even that fails.
+	 */
+	if (flags & FLAG_INCREMENTAL) {
+		if (ret < 0 && tgt_saved &&
+				restore_target(outfilp, infilp1, out_start,
+					out_size) < 0) {
+			if (infilp1)
+				printk("Target not restored, its tail is in %pD\n",
+						infilp1);
+			else
+				printk("Target not restored\n");
+		} else {
+			SAFE_REMOVE(infilp1);
+		}
+	}
+	xstream_release(&xin1);
+	xstream_release(&xin2);
+	xstream_release(&xout);
 	SAFE_PUTNAME(infile1);
 	SAFE_PUTNAME(infile2);
 	SAFE_PUTNAME(outfile);
-	SAFE_FILPCLOSE(infilp1);
-	SAFE_FILPCLOSE(infilp2);
+	SAFE_PUTNAME(idxfile);
+	SAFE_FREE(lo_key);
+	SAFE_FREE(hi_key);
+	SAFE_FREE(ix.ents);
+	shards_release(&sh, ret < 0 && merge_err == 0);
+	SAFE_FRELEASE(infilp1, flags);
+	SAFE_FRELEASE(infilp2, flags);
 	SAFE_FREE(inbuf1);
 	SAFE_FREE(inbuf2);
 	SAFE_FREE(outbuf);
@@ -622,14 +2973,22 @@ cleanup:
 					&rec_total, sizeof(rec_total)) != 0) {
 			ret = -EFAULT;
 		}
-		SAFE_FILPCLOSE(outfilp);
-		printk("Dumped sorted contents: %d bytes\n", bytes);
+		SAFE_FRELEASE(outfilp, flags);
+		SAFE_FILPCLOSE(ix.filp);
+		printk("Dumped sorted contents: %lld bytes\n", written);
 	} else {
-		if (merge_err == 0) {
+		/*
+		 * an already opened output or incremental target belongs to the
+		 * caller, keep it.
+		 */
+		if (merge_err == 0 &&
+				!(flags & (FLAG_FD_ARGS | FLAG_INCREMENTAL))) {
 			SAFE_REMOVE(outfilp);
 		}
-		SAFE_FILPCLOSE(outfilp);
-		printk("Couldn't complete successfully %d\n",ret);
+		SAFE_FRELEASE(outfilp, flags);
+		SAFE_REMOVE(ix.filp);
+		SAFE_FILPCLOSE(ix.filp);
+		printk("Couldn't complete successfully %ld\n", ret);
 	}
 	return ret;
 }
@@ -642,14 +3001,14 @@ cleanup:
  */
 asmlinkage long xmergesort(void *arg)
 {
-	int  		ret = 0;
+	long 		ret = 0;
 	/* dummy syscall: returns 0 for non null, -EINVAL for NULL */
 	if (arg == NULL) {
 		return -EINVAL;
 	}
 	printk ("arg ptr value:%p\n", arg);
 	ret  = read_and_merge_files(arg);
-	printk("xmergesort received ret  %d\n", ret);
+	printk("xmergesort received ret  %ld\n", ret);
 	return	ret; 
 }
 
@@ -6,13 +6,29 @@
 #ifndef _sys_xmergesort_
 #define _sys_xmergesort_
 
+#include <linux/types.h>
+
 typedef enum op_flags {
 	FLAG_ALL_REC	 	  = 1 << 0,
 	FLAG_UNIQUE_REC		= 1 << 1,
 	FLAG_IGNORE_CASE 	= 1 << 2,
 	FLAG_CHECK_SORTED	= 1 << 3,
 	FLAG_RET_CNT	 	  = 1 << 4,
-  FLAG_HELP         = 1 << 5
+  FLAG_HELP         = 1 << 5,
+	FLAG_DIRECT_IO		= 1 << 6,
+	FLAG_DROP_BEHIND	= 1 << 7,
+	FLAG_DECOMPRESS		= 1 << 8,
+	FLAG_COMPRESS		= 1 << 9,
+	FLAG_FD_ARGS		= 1 << 10,
+	FLAG_INCREMENTAL	= 1 << 11,
+	FLAG_INDEX		= 1 << 12,
+	FLAG_KEY_RANGE		= 1 << 13,
+	FLAG_SHARD		= 1 << 14,
+	FLAG_INTERSECT		= 1 << 15,	/* records in both inputs */
+	FLAG_DIFFERENCE		= 1 << 16,	/* records only in input 1 */
+	FLAG_SYM_DIFF		= 1 << 17,	/* records in exactly one input */
+	FLAG_COUNT_UNIQ		= 1 << 18,	/* unique records with their count */
+	FLAG_LZ4		= 1 << 19	/* FLAG_COMPRESS as LZ4 frames */
 } op_type;
 
 /* Parameter args*/
@@ -22,6 +38,55 @@ typedef struct merge_args {
 	const char	*outfile;
 	op_type		  flags;
 	u_int	      *records;
+	int		  infd1;	/* FLAG_FD_ARGS: already opened files */
+	int		  infd2;
+	int		  outfd;
+	const char	*idxfile;	/* FLAG_INDEX: sparse key index sidecar */
+	u_int		  idx_interval;	/* KB of output per index entry */
+	const char	*lo_key;	/* FLAG_KEY_RANGE: merge keys in [lo, hi), */
+	const char	*hi_key;	/* NULL for no bound */
+	__u64		  shard_size;	/* FLAG_SHARD: record bytes per shard, 0 for no limit */
+	const char	* const *shard_keys;	/* sorted keys each starting a new shard */
+	u_int		  nr_shard_keys;
+	struct xshard	*shards;	/* manifest, one entry per shard written */
+	u_int		  max_shards;	/* entries in shards */
+	u_int		  *nr_shards;	/* set to the number of shards written */
 } margs_t;
 
+/**
+ * Sharded output: shard n of the output is "<outfile>.<n>". Shards roll
+ * over on record boundaries only, so a single record is never split.
+ */
+#define XSHARD_MAX		1024
+#define XSHARD_NAME_LEN		256
+#define XSHARD_KEY_LEN		200	/* records are shorter than this */
+
+typedef struct xshard {
+	char	name[XSHARD_NAME_LEN];
+	char	first[XSHARD_KEY_LEN];	/* first record of the shard */
+	char	last[XSHARD_KEY_LEN];	/* last record of the shard */
+	__u64	bytes;			/* uncompressed bytes of records */
+	__u64	records;
+} xshard_t;
+
+/**
+ * Sparse key index sidecar: a header followed by one entry every
+ * interval KB of output, in output order.
+ */
+#define XIDX_MAGIC		0x58494458	/* "XIDX" */
+#define XIDX_KEY_LEN		24
+#define XIDX_DEF_INTERVAL	64
+
+typedef struct xidx_hdr {
+	__u32	magic;
+	__u32	interval;	/* KB */
+	__u32	flags;		/* FLAG_IGNORE_CASE of the merge */
+	__u32	count;		/* number of entries */
+} xidx_hdr_t;
+
+typedef struct xidx_entry {
+	__u64	offset;			/* output offset of the record */
+	char	key[XIDX_KEY_LEN];	/* record prefix, '\0' padded */
+} xidx_entry_t;
+
 #endif
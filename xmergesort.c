@@ -13,6 +13,8 @@
 #include <unistd.h>
 #include <err.h>
 #include <fcntl.h>
+#include <string.h>
+#include <strings.h>
 #include "sys_xmergesort.h"
 #ifndef __NR_xmergesort
 #error xmergesort system call not defined
@@ -20,8 +22,15 @@
 
 #define help_str                                                                    \
   "Possible invalid use. Help:\n"                                                   \
-  "./xmergesort [-uaitdh] outfile.txt file1.txt file2.txt\n"                        \
+  "./xmergesort [-uaitdObzZ4h] outfile.txt file1.txt file2.txt\n"                   \
+  "./xmergesort -f [-uaitdbzZ4h] outfd infd1 infd2\n"                               \
+  "./xmergesort -I [-uaitdbh] target.txt delta.txt\n"                               \
+  "./xmergesort [-L lo] [-H hi] [-uaitdbZ4h] outfile.txt file1.txt file2.txt\n"      \
+  "./xmergesort [-s bytes] [-S key]... [-uaitdObzZ4h] outfile.txt file1.txt file2.txt\n" \
+  "./xmergesort -j|-m|-e|-c [-uaitdObzZ4h] outfile.txt file1.txt file2.txt\n"      \
+  "./xmergesort -k key -x index outfile.txt\n"                                      \
   " -u and -a both are exclusive\n"                                                 \
+  " -O and -b both are exclusive\n"                                                 \
   " -u: output sorted records; if duplicates found, output only one copy\n"         \
   " -a: output all records, even if there are duplicates\n"                         \
   " -i: compare records case-insensitive (case sensitive by default)\n"             \
@@ -29,12 +38,128 @@
   "          error; otherwise continue to output records ONLY if any\n"             \
   "          are found that are in ascending order to what you've found so far\n"   \
   " -d: return the number of sorted records\n"                                      \
+  " -O: bypass the page cache, use direct I/O (O_DIRECT) for all files\n"           \
+  " -b: drop-behind, evict input and output pages from the page cache\n"           \
+  "          once they are consumed or written back\n"                             \
+  " -z: input files are gzip or LZ4 compressed, decompress them while merging\n"  \
+  " -Z: gzip compress the output file while merging\n"                             \
+  " -4: LZ4 compress the output file while merging\n"                              \
+  " -f: arguments are already opened file descriptors; inputs can be\n"           \
+  "          pipes or sockets and are read until end of file\n"                    \
+  " -I: incremental, merge a sorted delta into an existing sorted target,\n"       \
+  "          rewriting the target only from where the delta interleaves\n"         \
+  " -x index: write a sparse key index of the output to this file\n"              \
+  " -n KB: output between two index entries (default 64)\n"                        \
+  " -k key: print offset and first record >= key of outfile.txt, seeking\n"        \
+  "          with the index given by -x\n"                                          \
+  " -L lo: merge only records >= lo, seeking to them in each input\n"             \
+  " -H hi: merge only records < hi, stopping there in each input\n"               \
+  " -s bytes: split the output into outfile.txt.0, outfile.txt.1, ... of at\n"      \
+  "          most this many bytes of records each\n"                               \
+  " -S key: also start a new output shard at the first record >= key;\n"          \
+  "          can be given many times, in ascending order\n"                         \
+  " -j: output only records in both files\n"                                      \
+  " -m: output only records in file1 and not in file2\n"                          \
+  " -e: output only records in exactly one of the files\n"                        \
+  "          with -a, -j/-m/-e count copies like comm: a record n1 times in\n"     \
+  "          file1 and n2 times in file2 is output min(n1, n2) times for -j,\n"    \
+  "          n1 - n2 times for -m and |n1 - n2| times for -e\n"                     \
+  " -c: output each unique record once, prefixed by its number of copies\n"       \
+  "          in both files, like uniq -c\n"                                         \
+  " -j, -m, -e and -c are exclusive\n"                                             \
   " -h: help\n"
  
 void usage(void) {
 	printf(help_str);
 	return;
 }
+
+/**
+ * lookup_key - print the first record >= key of a merged output, seeking
+ *              straight to it with its sparse index
+ * @outfile: merged output file
+ * @idxfile: index written with -x
+ * @key: key to look up
+ *
+ * returns 0 if found, 1 if no record >= key, -1 on error.
+ */
+int lookup_key(const char *outfile, const char *idxfile, const char *key)
+{
+	FILE *idx, *out;
+	xidx_hdr_t hdr;
+	xidx_entry_t ent;
+	long lo, hi, mid;
+	off_t off = 0;
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	int cmp, rc = 1;
+
+	idx = fopen(idxfile, "r");
+	if (!idx) {
+		perror(idxfile);
+		return -1;
+	}
+	out = fopen(outfile, "r");
+	if (!out) {
+		perror(outfile);
+		fclose(idx);
+		return -1;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, idx) != 1 || hdr.magic != XIDX_MAGIC) {
+		fprintf(stderr, "%s: not an xmergesort index\n", idxfile);
+		rc = -1;
+		goto out;
+	}
+
+	/*
+	 * last entry whose key prefix sorts before the key: its record and
+	 * all before it sort before the key.
+	 */
+	lo = 0;
+	hi = hdr.count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (fseek(idx, sizeof(hdr) + mid * sizeof(ent), SEEK_SET) ||
+		    fread(&ent, sizeof(ent), 1, idx) != 1) {
+			perror(idxfile);
+			rc = -1;
+			goto out;
+		}
+		cmp = hdr.flags & FLAG_IGNORE_CASE ?
+			strncasecmp(ent.key, key, XIDX_KEY_LEN - 1) :
+			strncmp(ent.key, key, XIDX_KEY_LEN - 1);
+		if (cmp < 0) {
+			off = ent.offset;
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if (fseeko(out, off, SEEK_SET)) {
+		perror(outfile);
+		rc = -1;
+		goto out;
+	}
+	while ((len = getline(&line, &cap, out)) > 0) {
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		cmp = hdr.flags & FLAG_IGNORE_CASE ? strcasecmp(line, key) :
+			strcmp(line, key);
+		if (cmp >= 0) {
+			printf("%lld\t%s\n", (long long)off, line);
+			rc = 0;
+			break;
+		}
+		off += len;
+	}
+out:
+	free(line);
+	fclose(out);
+	fclose(idx);
+	return rc;
+}
 /**
  * To check EXTRA CREDIT code,
  * Uncomment this below macro
@@ -42,7 +167,7 @@ void usage(void) {
  */
 int main(int argc, char *argv[])
 {
-	int rc;
+	long rc;
 	int opt;
   u_int rec_counts = 0, total_recs = 0;
 	margs_t margs;
@@ -50,7 +175,19 @@ int main(int argc, char *argv[])
   const char *temp_outp;
 #endif
 	op_type option = 0;	
-	while ((opt = getopt(argc, argv, "uaitdh")) != -1) {
+	const char *idxfile = NULL, *key = NULL;
+	const char *lo_key = NULL, *hi_key = NULL;
+	u_int interval = 0;
+	unsigned long long shard_size = 0;
+	const char **shard_keys = NULL;
+	u_int nr_shard_keys = 0, nr_shards = 0, i;
+	op_type set_ops;
+	xshard_t *shards = NULL;
+
+	shard_keys = calloc(argc, sizeof(*shard_keys));
+	if (!shard_keys)
+		err(1, "calloc");
+	while ((opt = getopt(argc, argv, "uaitdObzZ4fIjmecx:n:k:L:H:s:S:h")) != -1) {
 		switch (opt) {
 		case 'u':
 			option |= FLAG_UNIQUE_REC;
@@ -67,6 +204,65 @@ int main(int argc, char *argv[])
 		case 'd':
 			option |= FLAG_RET_CNT;
 			break;
+		case 'O':
+			option |= FLAG_DIRECT_IO;
+			break;
+		case 'b':
+			option |= FLAG_DROP_BEHIND;
+			break;
+		case 'z':
+			option |= FLAG_DECOMPRESS;
+			break;
+		case 'Z':
+			option |= FLAG_COMPRESS;
+			break;
+		case '4':
+			option |= FLAG_COMPRESS | FLAG_LZ4;
+			break;
+		case 'f':
+			option |= FLAG_FD_ARGS;
+			break;
+		case 'I':
+			option |= FLAG_INCREMENTAL;
+			break;
+		case 'j':
+			option |= FLAG_INTERSECT;
+			break;
+		case 'm':
+			option |= FLAG_DIFFERENCE;
+			break;
+		case 'e':
+			option |= FLAG_SYM_DIFF;
+			break;
+		case 'c':
+			option |= FLAG_COUNT_UNIQ;
+			break;
+		case 'x':
+			option |= FLAG_INDEX;
+			idxfile = optarg;
+			break;
+		case 'n':
+			interval = atoi(optarg);
+			break;
+		case 'k':
+			key = optarg;
+			break;
+		case 'L':
+			option |= FLAG_KEY_RANGE;
+			lo_key = optarg;
+			break;
+		case 'H':
+			option |= FLAG_KEY_RANGE;
+			hi_key = optarg;
+			break;
+		case 's':
+			option |= FLAG_SHARD;
+			shard_size = strtoull(optarg, NULL, 10);
+			break;
+		case 'S':
+			option |= FLAG_SHARD;
+			shard_keys[nr_shard_keys++] = optarg;
+			break;
 		case 'h':
 			option |= FLAG_HELP;
 			break;
@@ -77,18 +273,71 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (key) {
+		if (!idxfile || optind >= argc) {
+			usage();
+			return -1;
+		}
+		return lookup_key(argv[optind], idxfile, key);
+	}
+
+	set_ops = option & (FLAG_INTERSECT | FLAG_DIFFERENCE | FLAG_SYM_DIFF |
+			    FLAG_COUNT_UNIQ);
 	if (((option & FLAG_ALL_REC) && (option & FLAG_UNIQUE_REC)) || !option ||
+      ((option & FLAG_DIRECT_IO) && (option & FLAG_DROP_BEHIND)) ||
+      ((option & FLAG_DIRECT_IO) &&
+       (option & (FLAG_COMPRESS | FLAG_DECOMPRESS | FLAG_FD_ARGS))) ||
+      ((option & FLAG_INCREMENTAL) &&
+       (option & (FLAG_DIRECT_IO | FLAG_COMPRESS | FLAG_DECOMPRESS | FLAG_FD_ARGS))) ||
+      ((option & FLAG_INDEX) &&
+       (option & (FLAG_COMPRESS | FLAG_FD_ARGS | FLAG_INCREMENTAL))) ||
+      ((option & FLAG_KEY_RANGE) &&
+       (option & (FLAG_DIRECT_IO | FLAG_DECOMPRESS | FLAG_INCREMENTAL))) ||
+      ((option & FLAG_SHARD) &&
+       (option & (FLAG_INDEX | FLAG_FD_ARGS | FLAG_INCREMENTAL))) ||
+      (set_ops & (set_ops - 1)) ||
+      (set_ops && (option & FLAG_INCREMENTAL)) ||
+      ((option & FLAG_COUNT_UNIQ) && ((option & FLAG_INDEX) || nr_shard_keys)) ||
       (option & FLAG_HELP)) {
 		usage();
 		return -1;
 	}
+	memset(&margs, 0, sizeof(margs));
   margs.flags = option;
-	margs.outfile = argv[optind++];
+	margs.idxfile = idxfile;
+	margs.idx_interval = interval;
+	margs.lo_key = lo_key;
+	margs.hi_key = hi_key;
+	if (option & FLAG_SHARD) {
+		shards = calloc(XSHARD_MAX, sizeof(*shards));
+		if (!shards)
+			err(1, "calloc");
+		margs.shard_size = shard_size;
+		margs.shard_keys = shard_keys;
+		margs.nr_shard_keys = nr_shard_keys;
+		margs.shards = shards;
+		margs.max_shards = XSHARD_MAX;
+		margs.nr_shards = &nr_shards;
+	}
+	if (option & FLAG_FD_ARGS) {
+		if (argc - optind < 3) {
+			usage();
+			return -1;
+		}
+		margs.outfd = atoi(argv[optind++]);
+		margs.infd1 = atoi(argv[optind++]);
+		margs.infd2 = atoi(argv[optind++]);
+	} else if (option & FLAG_INCREMENTAL) {
+		margs.outfile = argv[optind++];
+		margs.infile1 = argv[optind++];
+	} else {
+		margs.outfile = argv[optind++];
+		margs.infile1 = argv[optind++];
+		margs.infile2 = argv[optind++];
+	}
 #ifdef EXTRA_CREDIT
   temp_outp = margs.outfile;
 #endif
-	margs.infile1 = argv[optind++];
-	margs.infile2 = argv[optind++];
   margs.records = &rec_counts; 	
   rc = syscall(__NR_xmergesort, &margs);
 	if (rc < 0) {
@@ -100,6 +349,11 @@ int main(int argc, char *argv[])
     if (option & FLAG_RET_CNT) {
       printf("Total records written: %d\n", total_recs);
     }
+    /* manifest: name, first and last record, bytes, records */
+    for (i = 0; i < nr_shards; i++)
+      printf("%s\t%s\t%s\t%llu\t%llu\n", shards[i].name, shards[i].first,
+             shards[i].last, (unsigned long long)shards[i].bytes,
+             (unsigned long long)shards[i].records);
   }
 #ifdef EXTRA_CREDIT 
   while (optind < argc) {